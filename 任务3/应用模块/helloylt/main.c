@@ -1,6 +1,1179 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "page_alloc_shared.h"
+
+/*
+ * 与内核page_alloc.c中struct fa_snapshot的布局保持一致。
+ * 由"helloylt snapshot [文件]"读取并渲染成文本。
+ */
+#define FA_SNAPSHOT_MAGIC   0x46415331
+#define FA_SNAPSHOT_ORDERS  16
+#define FA_SNAPSHOT_ZONES   32
+#define FA_SNAPSHOT_PATH    "/sys/kernel/debug/page_alloc/free_area_snapshot"
+
+struct fa_snapshot_zone {
+    uint32_t node;
+    uint32_t zone_idx;
+    char name[8];
+    uint64_t free_pages;
+    uint64_t min;
+    uint64_t low;
+    uint64_t high;
+    uint64_t present_pages;
+    uint32_t nr_free[FA_SNAPSHOT_ORDERS];
+    uint8_t type_mask[FA_SNAPSHOT_ORDERS];
+};
+
+struct fa_snapshot {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t timestamp_ns;
+    uint32_t cpu;
+    uint32_t gfp_mask;
+    uint32_t order;
+    uint32_t nr_zones;
+    uint64_t caller;
+    char comm[16];
+    struct fa_snapshot_zone zones[FA_SNAPSHOT_ZONES];
+};
+
+/* 与内核的migratetype顺序一致：UNMOVABLE, RECLAIMABLE, MOVABLE, RESERVE, ISOLATE */
+static const char type_chars[] = "UEMRI";
+
+static int show_snapshot(const char *path)
+{
+    struct fa_snapshot snap;
+    FILE *fp;
+    size_t len;
+    unsigned long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    uint32_t i;
+    int order, t;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return 1;
+    }
+    len = fread(&snap, 1, sizeof(snap), fp);
+    fclose(fp);
+
+    if (len == 0) {
+        printf("no allocation failure recorded\n");
+        return 0;
+    }
+    if (len != sizeof(snap) || snap.magic != FA_SNAPSHOT_MAGIC) {
+        fprintf(stderr, "%s: unknown snapshot format\n", path);
+        return 1;
+    }
+
+    printf("allocation failure: comm %.16s cpu %u order %u gfp 0x%x caller 0x%llx at %llu.%06llu\n",
+           snap.comm, snap.cpu, snap.order, snap.gfp_mask,
+           (unsigned long long)snap.caller,
+           (unsigned long long)(snap.timestamp_ns / 1000000000ULL),
+           (unsigned long long)(snap.timestamp_ns % 1000000000ULL / 1000));
+
+    if (snap.nr_zones > FA_SNAPSHOT_ZONES)
+        snap.nr_zones = FA_SNAPSHOT_ZONES;
+    for (i = 0; i < snap.nr_zones; i++) {
+        struct fa_snapshot_zone *z = &snap.zones[i];
+
+        printf("Node %u %.8s free:%llu min:%llu low:%llu high:%llu present:%llu\n",
+               z->node, z->name,
+               (unsigned long long)z->free_pages,
+               (unsigned long long)z->min,
+               (unsigned long long)z->low,
+               (unsigned long long)z->high,
+               (unsigned long long)z->present_pages);
+        printf("  ");
+        for (order = 0; order < FA_SNAPSHOT_ORDERS; order++) {
+            if (!z->nr_free[order] && !z->type_mask[order])
+                continue;
+            printf("%u*%luk (", z->nr_free[order], page_kb << order);
+            for (t = 0; t < (int)strlen(type_chars); t++)
+                if (z->type_mask[order] & (1 << t))
+                    putchar(type_chars[t]);
+            printf(") ");
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
+
+/*
+ * 用合成的距离/延迟矩阵检验实测延迟如何改变回退顺序。换算和排序用的是
+ * 内核同一份pa_latency_locality()和pa_node_rank()，这里只替代
+ * node_latency[]、cpumask_of_node()和节点遍历。
+ * 由"helloylt locality"运行，全部通过时返回0。
+ */
+#define LOC_MAX_NODES               4
+
+struct locality_case {
+    const char *name;
+    int nr_nodes;
+    int from;
+    int has_cpus[LOC_MAX_NODES];
+    int distance[LOC_MAX_NODES][LOC_MAX_NODES];
+    unsigned int latency[LOC_MAX_NODES][LOC_MAX_NODES]; /* 0表示没有测量 */
+    int expect[LOC_MAX_NODES];  /* from节点的回退顺序 */
+};
+
+static const struct locality_case locality_cases[] = {
+    {
+        "distance only", 4, 0, { 1, 1, 1, 1 },
+        { { 10, 20, 30, 20 }, { 20, 10, 20, 30 },
+          { 30, 20, 10, 20 }, { 20, 30, 20, 10 } },
+        { { 0 } },
+        { 0, 1, 3, 2 },
+    },
+    {
+        "measured latency overrides distance", 4, 0, { 1, 1, 1, 1 },
+        { { 10, 20, 30, 20 }, { 20, 10, 20, 30 },
+          { 30, 20, 10, 20 }, { 20, 30, 20, 10 } },
+        { { 100, 250, 120, 200 } },
+        { 0, 2, 3, 1 },
+    },
+    {
+        "unmeasured pair falls back to distance", 4, 0, { 1, 1, 1, 1 },
+        { { 10, 20, 30, 20 }, { 20, 10, 20, 30 },
+          { 30, 20, 10, 20 }, { 20, 30, 20, 10 } },
+        { { 100, 250, 0, 200 } },
+        { 0, 3, 1, 2 },
+    },
+    {
+        "no local latency uses distance", 4, 0, { 1, 1, 1, 1 },
+        { { 10, 30, 20, 20 }, { 30, 10, 20, 20 },
+          { 20, 20, 10, 30 }, { 20, 20, 30, 10 } },
+        { { 0, 100, 400, 400 } },
+        { 0, 2, 3, 1 },
+    },
+    {
+        "rounding to nearest", 3, 0, { 1, 1, 1 },
+        { { 10, 20, 20 }, { 20, 10, 20 }, { 20, 20, 10 } },
+        /* 1350/90 = 15.0, 1300/90 = 14.4 */
+        { { 90, 135, 130 } },
+        { 0, 2, 1 },
+    },
+    {
+        "lower node and cpu penalties", 4, 2, { 1, 1, 1, 0 },
+        { { 10, 20, 20, 20 }, { 20, 10, 20, 20 },
+          { 20, 20, 10, 20 }, { 20, 20, 20, 10 } },
+        { { 0 } },
+        /* 节点3没有CPU，节点0和1低于起点各罚1 */
+        { 2, 3, 0, 1 },
+    },
+};
+
+static int node_locality(const struct locality_case *c, int from, int to)
+{
+    return pa_latency_locality(c->latency[from][from], c->latency[from][to],
+                               c->distance[from][to]);
+}
+
+/* node_load[]在第一次构建时全为0，这里省略 */
+static int find_next_best_node(const struct locality_case *c, int node,
+                               int *used)
+{
+    int n, val, min_val = 0x7fffffff, best_node = -1;
+
+    if (!used[node]) {
+        used[node] = 1;
+        return node;
+    }
+
+    for (n = 0; n < c->nr_nodes; n++) {
+        if (used[n])
+            continue;
+        val = pa_node_rank(node_locality(c, node, n), node, n,
+                           c->has_cpus[n], c->nr_nodes * LOC_MAX_NODES, 0);
+        if (val < min_val) {
+            min_val = val;
+            best_node = n;
+        }
+    }
+
+    if (best_node >= 0)
+        used[best_node] = 1;
+    return best_node;
+}
+
+static int test_locality(void)
+{
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(locality_cases) / sizeof(locality_cases[0]); i++) {
+        const struct locality_case *c = &locality_cases[i];
+        int used[LOC_MAX_NODES] = { 0 };
+        int order[LOC_MAX_NODES];
+        int j, ok = 1;
+
+        for (j = 0; j < c->nr_nodes; j++) {
+            order[j] = find_next_best_node(c, c->from, used);
+            if (order[j] != c->expect[j])
+                ok = 0;
+        }
+
+        printf("%s: %s (", ok ? "PASS" : "FAIL", c->name);
+        for (j = 0; j < c->nr_nodes; j++)
+            printf("%s%d", j ? " " : "", order[j]);
+        printf(")\n");
+        failed += !ok;
+    }
+
+    return failed ? 1 : 0;
+}
+
+/*
+ * 用户态虚拟地址条带模型，不经过内核的page_colours=N路径：布局完全由
+ * 这里选的虚拟偏移决定，测的是"假如内核把颜色分对了"能省下多少冲突
+ * 缺失。每个缓冲区占一页，依次按缓存行交错访问所有缓冲区。"aliased"
+ * 布局中每个缓冲区都从同一种颜色开始；"coloured"布局给第i个缓冲区
+ * 第i % N种颜色。只有在虚拟索引的缓存（MIPS）上虚拟偏移才等于颜色。
+ *
+ * 内核那一侧由最后的"kernel"一行检查：按缓冲区逐页缺页后从
+ * /proc/self/pagemap读出物理页号（需要root），统计内核实际给出的物理
+ * 颜色。打开page_colours=N时各颜色应当大致均匀；读不到pagemap时跳过。
+ * 用法："helloylt stripe [颜色数] [缓冲区数] [遍数]"。
+ */
+#define STRIPE_COLOURS  4
+#define STRIPE_BUFFERS  16
+#define STRIPE_PASSES   2000
+#define STRIPE_ROUNDS   3   /* 两种布局交替测量，各取最好的一次 */
+
+static unsigned long stripe_line_size(void)
+{
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+    long line = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+
+    if (line > 0)
+        return line;
+#endif
+    return 32;
+}
+
+static double stripe_run(char **bufs, unsigned long nr_bufs,
+                         unsigned long page_size, unsigned long line,
+                         unsigned long passes)
+{
+    struct timeval start, end;
+    volatile unsigned long sum = 0;
+    unsigned long pass, off, i;
+
+    /* 先走一遍，把缺页和TLB填充排除在计时之外 */
+    for (i = 0; i < nr_bufs; i++)
+        for (off = 0; off < page_size; off += line)
+            sum += bufs[i][off];
+
+    gettimeofday(&start, NULL);
+    for (pass = 0; pass < passes; pass++)
+        for (off = 0; off < page_size; off += line)
+            for (i = 0; i < nr_bufs; i++)
+                sum += *(volatile char *)(bufs[i] + off);
+    gettimeofday(&end, NULL);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_usec - start.tv_usec) * 1e3) /
+           ((double)passes * nr_bufs * (page_size / line));
+}
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN     ((1ULL << 55) - 1)
+
+/* 统计[area, area + nr_pages页)实际落在哪些物理颜色上，返回读到的页数 */
+static unsigned long stripe_pfn_colours(void *area, unsigned long nr_pages,
+                                        unsigned long page_size,
+                                        unsigned long colours,
+                                        unsigned long *hist)
+{
+    unsigned long i, seen = 0;
+    uint64_t ent;
+    FILE *fp = fopen("/proc/self/pagemap", "rb");
+
+    if (!fp)
+        return 0;
+    for (i = 0; i < nr_pages; i++) {
+        long off = (long)(((uintptr_t)area / page_size + i) * sizeof(ent));
+
+        if (fseek(fp, off, SEEK_SET) || fread(&ent, sizeof(ent), 1, fp) != 1)
+            break;
+        /* 没有权限时内核把pfn清零 */
+        if (!(ent & PAGEMAP_PRESENT) || !(ent & PAGEMAP_PFN))
+            continue;
+        hist[(ent & PAGEMAP_PFN) & (colours - 1)]++;
+        seen++;
+    }
+    fclose(fp);
+    return seen;
+}
+
+static int bench_stripe(int argc, char *argv[])
+{
+    unsigned long colours = argc > 2 ? strtoul(argv[2], NULL, 0) : STRIPE_COLOURS;
+    unsigned long nr_bufs = argc > 3 ? strtoul(argv[3], NULL, 0) : STRIPE_BUFFERS;
+    unsigned long passes = argc > 4 ? strtoul(argv[4], NULL, 0) : STRIPE_PASSES;
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long line = stripe_line_size();
+    unsigned long way, i, seen;
+    unsigned long *hist;
+    double aliased = 0, coloured = 0, ns;
+    int round;
+    char **bufs;
+    void *area;
+
+    if (!colours || (colours & (colours - 1)) || !nr_bufs || !passes) {
+        fprintf(stderr, "stripe: colours must be a power of 2, "
+                "buffers and passes non-zero\n");
+        return 1;
+    }
+
+    way = colours * page_size;
+    bufs = calloc(nr_bufs, sizeof(*bufs));
+    if (!bufs || posix_memalign(&area, way, nr_bufs * way)) {
+        fprintf(stderr, "stripe: out of memory\n");
+        free(bufs);
+        return 1;
+    }
+    /* 按地址顺序逐页缺页，和内核每CPU的颜色轮转顺序对应 */
+    for (i = 0; i < nr_bufs * colours; i++)
+        memset((char *)area + i * page_size, 1, page_size);
+
+    for (round = 0; round < STRIPE_ROUNDS; round++) {
+        for (i = 0; i < nr_bufs; i++)
+            bufs[i] = (char *)area + i * way;
+        ns = stripe_run(bufs, nr_bufs, page_size, line, passes);
+        if (!round || ns < aliased)
+            aliased = ns;
+
+        for (i = 0; i < nr_bufs; i++)
+            bufs[i] = (char *)area + i * way + (i % colours) * page_size;
+        ns = stripe_run(bufs, nr_bufs, page_size, line, passes);
+        if (!round || ns < coloured)
+            coloured = ns;
+    }
+
+    printf("userspace virtual-address striping model\n");
+    printf("colours %lu buffers %lu line %lu passes %lu\n",
+           colours, nr_bufs, line, passes);
+    printf("aliased   %.2f ns/access\n", aliased);
+    printf("coloured  %.2f ns/access\n", coloured);
+    printf("speedup   %.2fx\n", coloured > 0 ? aliased / coloured : 0.0);
+
+    hist = calloc(colours, sizeof(*hist));
+    seen = hist ? stripe_pfn_colours(area, nr_bufs * colours, page_size,
+                                     colours, hist) : 0;
+    if (seen) {
+        printf("kernel    physical colours of %lu pages:", seen);
+        for (i = 0; i < colours; i++)
+            printf(" %lu", hist[i]);
+        printf("\n");
+    } else
+        printf("kernel    pagemap pfns unavailable, skipped\n");
+    free(hist);
+
+    free(area);
+    free(bufs);
+    return 0;
+}
+
+/*
+ * 1GB范围的空闲页分类基准。用page_alloc_shared.h中内核同一份
+ * pa_free_block_end()和pa_walk_free_blocks()，在一个合成的伙伴布局上
+ * 比较逐页探测（is_free_buddy_page()的做法）和按块跳过的整段查询
+ * （classify_free_range()的做法），并检查两者的结果一致。合成布局不
+ * 计入zone->lock和关中断的代价：内核里逐页查询每页都要拿一次锁，
+ * 整段查询每个页块一次。
+ *
+ * debugfs中有page_alloc/free_range时，再让内核对真实的
+ * [起始pfn, +1GB)各跑一次两种查询并报告耗时。
+ * 用法："helloylt freerange [起始pfn]"。
+ */
+#define FR_MAX_ORDER        11
+#define FR_PAGEBLOCK_PAGES  512
+#define FR_ROUNDS           3
+#define FR_DEBUGFS_PATH     "/sys/kernel/debug/page_alloc/free_range"
+
+struct fr_layout {
+    signed char *order;     /* 空闲块的头页为阶，其他为PA_NOT_BUDDY */
+    unsigned long nr;
+};
+
+static int fr_buddy_order(unsigned long pfn, void *arg)
+{
+    struct fr_layout *l = arg;
+
+    return pfn < l->nr ? l->order[pfn] : PA_OTHER_ZONE;
+}
+
+/* 随机的对齐块，大约一半空闲，阶偏向低阶，和长时间运行后的区相似 */
+static void fr_build_layout(struct fr_layout *l)
+{
+    unsigned long pfn = 0, seed = 12345;
+
+    memset(l->order, PA_NOT_BUDDY, l->nr);
+    while (pfn < l->nr) {
+        int order;
+
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        order = (seed >> 33) % FR_MAX_ORDER;
+        order = order * order / (FR_MAX_ORDER - 1);
+        while (order && (pfn & ((1UL << order) - 1)))
+            order--;
+        if ((seed >> 20) & 1)
+            l->order[pfn] = order;
+        pfn += 1UL << order;
+    }
+}
+
+static double fr_now_ns(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static unsigned long fr_per_pfn(struct fr_layout *l)
+{
+    unsigned long pfn, nr_free = 0;
+
+    for (pfn = 0; pfn < l->nr; pfn++)
+        nr_free += pa_free_block_end(pfn, FR_MAX_ORDER, fr_buddy_order, l) != 0;
+    return nr_free;
+}
+
+/* 和classify_free_range()一样按页块分段 */
+static unsigned long fr_range(struct fr_layout *l)
+{
+    unsigned long pfn = 0, nr_free = 0;
+
+    while (pfn < l->nr) {
+        unsigned long end = (pfn | (FR_PAGEBLOCK_PAGES - 1)) + 1;
+
+        if (end > l->nr)
+            end = l->nr;
+        pfn = pa_walk_free_blocks(pfn, end,
+                pa_free_block_end(pfn, FR_MAX_ORDER, fr_buddy_order, l),
+                fr_buddy_order, NULL, l, &nr_free);
+    }
+    return nr_free;
+}
+
+/* 让内核跑一次查询，返回耗时的纳秒数，失败返回-1 */
+static long long fr_kernel(unsigned long start, unsigned long nr,
+                           const char *mode, unsigned long *nr_free)
+{
+    char line[64];
+    long long ns = -1;
+    FILE *fp = fopen(FR_DEBUGFS_PATH, "w");
+
+    if (!fp)
+        return -1;
+    fprintf(fp, "%lu %lu %s\n", start, nr, mode);
+    if (fclose(fp))
+        return -1;
+
+    fp = fopen(FR_DEBUGFS_PATH, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "free %lu", nr_free);
+        sscanf(line, "ns %lld", &ns);
+    }
+    fclose(fp);
+    return ns;
+}
+
+static int bench_freerange(int argc, char *argv[])
+{
+    unsigned long start = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+    struct fr_layout l;
+    unsigned long a = 0, b = 0, nr_free;
+    double t, per_pfn = 0, range = 0;
+    long long kpfn, krange;
+    int round;
+
+    l.nr = (1UL << 30) / sysconf(_SC_PAGESIZE);
+    l.order = malloc(l.nr);
+    if (!l.order) {
+        fprintf(stderr, "freerange: out of memory\n");
+        return 1;
+    }
+    fr_build_layout(&l);
+
+    for (round = 0; round < FR_ROUNDS; round++) {
+        t = fr_now_ns();
+        a = fr_per_pfn(&l);
+        t = fr_now_ns() - t;
+        if (!round || t < per_pfn)
+            per_pfn = t;
+
+        t = fr_now_ns();
+        b = fr_range(&l);
+        t = fr_now_ns() - t;
+        if (!round || t < range)
+            range = t;
+    }
+    free(l.order);
+
+    printf("synthetic 1GB layout, %lu pfns, %lu free\n", l.nr, a);
+    printf("per-pfn   %.2f ms\n", per_pfn / 1e6);
+    printf("range     %.2f ms\n", range / 1e6);
+    printf("speedup   %.2fx\n", range > 0 ? per_pfn / range : 0.0);
+    if (a != b) {
+        printf("FAIL: per-pfn found %lu free pages, range %lu\n", a, b);
+        return 1;
+    }
+
+    krange = fr_kernel(start, l.nr, "", &nr_free);
+    if (krange < 0) {
+        printf("kernel    %s unavailable, skipped\n", FR_DEBUGFS_PATH);
+        return 0;
+    }
+    printf("kernel    pfn %lu-%lu: %lu free\n", start, start + l.nr, nr_free);
+    printf("kernel    range   %.2f ms\n", krange / 1e6);
+    kpfn = fr_kernel(start, l.nr, "pfn", &nr_free);
+    if (kpfn < 0)
+        printf("kernel    per-pfn unavailable (no CONFIG_MEMORY_FAILURE)\n");
+    else
+        printf("kernel    per-pfn %.2f ms\n", kpfn / 1e6);
+    return 0;
+}
+
+/*
+ * 确定性故障注入的用户态一侧。用内核同一份pa_fail_replay_hit()，按
+ * fail_page_alloc/replay-seed、replay-period和replay-schedule的设置列出
+ * 前count个序号中会失败的分配，驱动的测试可以据此预先知道哪一次分配
+ * 失败。debugfs中有replay-log时，再检查内核记录的每个失败序号都在预测
+ * 之中，不一致时返回1。
+ * 用法："helloylt replay 种子 周期 count [调度序号...]"。
+ */
+#define REPLAY_SCHEDULE     64  /* FAIL_REPLAY_SCHEDULE */
+#define REPLAY_LOG_PATH     "/sys/kernel/debug/fail_page_alloc/replay-log"
+
+static int replay_cmp(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int replay_predict(int argc, char *argv[])
+{
+    unsigned int schedule[REPLAY_SCHEDULE];
+    unsigned int seed, period, index;
+    unsigned long count, i;
+    int nr = 0, logged = 0, bad = 0;
+    char line[256];
+    FILE *fp;
+
+    if (argc < 5 || argc - 5 > REPLAY_SCHEDULE) {
+        fprintf(stderr, "usage: helloylt replay seed period count "
+                "[index...]\n");
+        return 1;
+    }
+    seed = strtoul(argv[2], NULL, 0);
+    period = strtoul(argv[3], NULL, 0);
+    count = strtoul(argv[4], NULL, 0);
+    for (i = 5; i < (unsigned long)argc; i++)
+        schedule[nr++] = strtoul(argv[i], NULL, 0);
+    /* 内核写入调度表时同样排序 */
+    qsort(schedule, nr, sizeof(schedule[0]), replay_cmp);
+
+    printf("seed %u period %u schedule %d, failing indices < %lu:",
+           seed, period, nr, count);
+    for (i = 0; i < count; i++)
+        if (pa_fail_replay_hit(seed, period, i, schedule, nr))
+            printf(" %lu", i);
+    printf("\n");
+
+    fp = fopen(REPLAY_LOG_PATH, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%u", &index) != 1)
+            continue;   /* 表头 */
+        logged++;
+        if (!pa_fail_replay_hit(seed, period, index, schedule, nr)) {
+            printf("FAIL: kernel failed index %u, not predicted\n", index);
+            bad++;
+        }
+    }
+    fclose(fp);
+    printf("%s: %d kernel replay-log records checked\n",
+           bad ? "FAIL" : "PASS", logged);
+    return bad ? 1 : 0;
+}
+
+/*
+ * 高阶块struct page检查的每阶周期数。内核的page_alloc/page_check_cycles
+ * 在真实的块上运行check_new_pages()和free_pages_check_range()，这里把
+ * 每块的周期数换算成每页的周期数，并给出REDUCE相对FULL的加速比。
+ * 用法："helloylt pagecheck"。
+ */
+#define PAGECHECK_PATH  "/sys/kernel/debug/page_alloc/page_check_cycles"
+
+static int show_pagecheck(void)
+{
+    unsigned long c[5];
+    char line[256];
+    int order, rows = 0;
+    FILE *fp = fopen(PAGECHECK_PATH, "r");
+
+    if (!fp) {
+        perror(PAGECHECK_PATH);
+        return 1;
+    }
+
+    printf("cycles per page (alloc: headtail reduce full | free: reduce full)\n");
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long nr;
+        int i;
+
+        if (sscanf(line, "%d %lu %lu %lu %lu %lu", &order, &c[0], &c[1],
+                   &c[2], &c[3], &c[4]) != 6)
+            continue;
+        nr = 1UL << order;
+        printf("order %2d:", order);
+        for (i = 0; i < 5; i++)
+            printf(" %7.2f", (double)c[i] / nr);
+        printf("  alloc x%.2f free x%.2f\n",
+               c[1] ? (double)c[2] / c[1] : 0.0,
+               c[3] ? (double)c[4] / c[3] : 0.0);
+        rows++;
+    }
+    /* 有检查失败时内核返回-EIO */
+    if (ferror(fp) || !rows) {
+        fprintf(stderr, "pagecheck: no results from %s\n", PAGECHECK_PATH);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * 慢速路径剖析的记账检验。打开page_alloc/slowpath_profile，给
+ * fail_page_alloc/inject-reclaim-fail和inject-compact-fail各装上若干次
+ * 注入，然后分配并写满MB兆内存制造压力。之后检查：
+ * - 每个阶段直方图的总数等于调用次数，成功次数不超过调用次数；
+ * - 被消耗掉的每一次注入都作为一次失败的reclaim/compact阶段记了账；
+ * - slowpath_worst中每条记录的阶段耗时之和不超过总耗时。
+ * 没有进入慢速路径时注入不会被消耗，检查照样进行，只是没有覆盖注入。
+ * 用法："helloylt slowpath [MB] [注入次数]"。
+ */
+#define SP_DIR          "/sys/kernel/debug/page_alloc/"
+#define SP_FAIL_DIR     "/sys/kernel/debug/fail_page_alloc/"
+#define SP_STAGES       8
+#define SP_HIST         32
+#define SP_MB           256
+#define SP_INJECT       4
+
+static const char *const sp_stage_names[SP_STAGES] = {
+    "wake_kswapd", "freelist", "high_priority", "compact",
+    "reclaim", "oom", "retry_wait", "total",
+};
+
+struct sp_stats {
+    unsigned long calls[SP_STAGES];
+    unsigned long success[SP_STAGES];
+    unsigned long hist_sum[SP_STAGES];
+};
+
+static int sp_write(const char *path, unsigned long val)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp)
+        return -1;
+    fprintf(fp, "%lu\n", val);
+    return fclose(fp) ? -1 : 0;
+}
+
+static long sp_read(const char *path)
+{
+    long val = -1;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return -1;
+    if (fscanf(fp, "%ld", &val) != 1)
+        val = -1;
+    fclose(fp);
+    return val;
+}
+
+static int sp_read_stats(struct sp_stats *st)
+{
+    char line[1024], name[32];
+    unsigned long calls, success;
+    unsigned long long ns;
+    int stage = -1, i;
+    FILE *fp = fopen(SP_DIR "slowpath_stats", "r");
+
+    if (!fp)
+        return -1;
+    memset(st, 0, sizeof(*st));
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%31s calls %lu success %lu ns %llu",
+                   name, &calls, &success, &ns) == 4) {
+            stage = -1;
+            for (i = 0; i < SP_STAGES; i++)
+                if (!strcmp(name, sp_stage_names[i]))
+                    stage = i;
+            if (stage >= 0) {
+                st->calls[stage] = calls;
+                st->success[stage] = success;
+            }
+        } else if (stage >= 0 && !strncmp(line, "  hist", 6)) {
+            char *p = line + 6, *end;
+
+            for (i = 0; i < SP_HIST; i++, p = end)
+                st->hist_sum[stage] += strtoul(p, &end, 10);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* 每CPU的统计不加锁汇总，正在更新的CPU可能让计数差一，重读一次 */
+static int sp_check_stats(struct sp_stats *st)
+{
+    int i, tries, bad = 0;
+
+    for (tries = 0; tries < 2; tries++) {
+        bad = 0;
+        for (i = 0; i < SP_STAGES; i++)
+            if (st->hist_sum[i] != st->calls[i] ||
+                st->success[i] > st->calls[i])
+                bad = i + 1;
+        if (!bad || sp_read_stats(st))
+            break;
+    }
+    if (bad)
+        printf("FAIL: %s calls %lu success %lu hist %lu\n",
+               sp_stage_names[bad - 1], st->calls[bad - 1],
+               st->success[bad - 1], st->hist_sum[bad - 1]);
+    return bad != 0;
+}
+
+static int sp_check_worst(void)
+{
+    char line[2048];
+    int bad = 0, lines = 0;
+    FILE *fp = fopen(SP_DIR "slowpath_worst", "r");
+
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long total, sum = 0;
+        unsigned int order, mode;
+        int steps;
+        char *p = strchr(line, ':');
+
+        if (!p || sscanf(line, "total %llu ns order %u mode %x steps %d",
+                         &total, &order, &mode, &steps) != 4)
+            continue;
+        lines++;
+        /* 每一步是"阶段+/纳秒"或"阶段-/纳秒" */
+        while ((p = strchr(p, '/')) != NULL)
+            sum += strtoull(p + 1, &p, 10);
+        if (sum > total) {
+            printf("FAIL: worst trace steps %llu ns > total %llu ns\n",
+                   sum, total);
+            bad++;
+        }
+    }
+    fclose(fp);
+    printf("worst traces checked: %d\n", lines);
+    return bad;
+}
+
+static int test_slowpath(int argc, char *argv[])
+{
+    unsigned long mb = argc > 2 ? strtoul(argv[2], NULL, 0) : SP_MB;
+    unsigned long inject = argc > 3 ? strtoul(argv[3], NULL, 0) : SP_INJECT;
+    long left_reclaim, left_compact;
+    unsigned long used_reclaim = 0, used_compact = 0, fail_reclaim, fail_compact;
+    struct sp_stats before, after;
+    int injecting, bad = 0;
+    char *buf;
+
+    if (sp_write(SP_DIR "slowpath_profile", 1) || sp_read_stats(&before)) {
+        fprintf(stderr, "slowpath: %s not available\n", SP_DIR);
+        return 1;
+    }
+    injecting = !sp_write(SP_FAIL_DIR "inject-reclaim-fail", inject) &&
+                !sp_write(SP_FAIL_DIR "inject-compact-fail", inject);
+    if (!injecting)
+        printf("no %s, checking without injection\n", SP_FAIL_DIR);
+
+    buf = malloc(mb << 20);
+    if (buf) {
+        memset(buf, 1, mb << 20);
+        free(buf);
+    }
+
+    if (sp_read_stats(&after)) {
+        fprintf(stderr, "slowpath: cannot reread stats\n");
+        return 1;
+    }
+    bad |= sp_check_stats(&after);
+
+    if (injecting) {
+        left_reclaim = sp_read(SP_FAIL_DIR "inject-reclaim-fail");
+        left_compact = sp_read(SP_FAIL_DIR "inject-compact-fail");
+        /* 不让剩下的注入影响之后的分配 */
+        sp_write(SP_FAIL_DIR "inject-reclaim-fail", 0);
+        sp_write(SP_FAIL_DIR "inject-compact-fail", 0);
+        if (left_reclaim >= 0)
+            used_reclaim = inject - left_reclaim;
+        if (left_compact >= 0)
+            used_compact = inject - left_compact;
+    }
+    fail_reclaim = (after.calls[4] - after.success[4]) -
+                   (before.calls[4] - before.success[4]);
+    fail_compact = (after.calls[3] - after.success[3]) -
+                   (before.calls[3] - before.success[3]);
+    printf("slowpath entries %lu, reclaim failures %lu (injected %lu), "
+           "compact failures %lu (injected %lu)\n",
+           after.calls[7] - before.calls[7], fail_reclaim, used_reclaim,
+           fail_compact, used_compact);
+    if (fail_reclaim < used_reclaim || fail_compact < used_compact) {
+        printf("FAIL: injected outcomes missing from the stage counters\n");
+        bad = 1;
+    }
+    bad |= sp_check_worst();
+
+    printf("%s: slowpath accounting\n", bad ? "FAIL" : "PASS");
+    return bad;
+}
+
+/*
+ * 清零的吞吐量和缓存污染。内核的page_alloc/zero_bench在真实的块上分别
+ * 用普通清零和__GFP_COLD调用prep_zero_page()；这里把热缓冲区清零前后
+ * 的读取时间换算成污染比例（之后比之前慢了多少）。
+ * 用法："helloylt zero"。
+ */
+#define ZERO_BENCH_PATH "/sys/kernel/debug/page_alloc/zero_bench"
+
+static int show_zero(void)
+{
+    char line[256], mode[16];
+    unsigned long long mbps, before, after;
+    int order, rows = 0;
+    FILE *fp = fopen(ZERO_BENCH_PATH, "r");
+
+    if (!fp) {
+        perror(ZERO_BENCH_PATH);
+        return 1;
+    }
+    printf("order mode     MB/s   hot-set slowdown after zeroing\n");
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%d %15s %llu %llu %llu", &order, mode, &mbps,
+                   &before, &after) != 5)
+            continue;
+        printf("%5d %-7s %7llu   %+.1f%%\n", order, mode, mbps,
+               before ? (after - (double)before) * 100.0 / before : 0.0);
+        rows++;
+    }
+    fclose(fp);
+    return rows ? 0 : 1;
+}
+
+/*
+ * 延迟释放省下的软中断时间。在回环接口上向一个从不读取、接收缓冲区
+ * 很小的UDP套接字连续发送大数据报：超出接收缓冲区的报文在NET_RX软
+ * 中断里被丢弃，数据所在的高阶页面在软中断上下文中释放，这里用它代替
+ * 网卡的TX完成路径。分别在page_alloc/deferred_free为0和1时运行同样
+ * 长的时间，比较/proc/stat中的softirq时间（按USER_HZ计，较粗）和每万个
+ * 数据报的软中断时间，并报告被推迟释放的页数。结束后恢复原来的设置。
+ * 用法："helloylt softirq [秒数] [数据报字节数]"。
+ */
+#define SOFTIRQ_SECS        3
+#define SOFTIRQ_DGRAM       32768   /* 数据部分跨越多个页，kmalloc走高阶页 */
+#define SOFTIRQ_DEFERRED    "/sys/kernel/debug/page_alloc/deferred_free"
+#define SOFTIRQ_STATS       "/sys/kernel/debug/page_alloc/deferred_free_stats"
+
+static unsigned long long softirq_ticks(void)
+{
+    unsigned long long v[7] = { 0 };
+    FILE *fp = fopen("/proc/stat", "r");
+
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1],
+               &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+        v[6] = 0;
+    fclose(fp);
+    return v[6];
+}
+
+static unsigned long softirq_deferred_pages(void)
+{
+    char line[128];
+    unsigned long val = 0;
+    FILE *fp = fopen(SOFTIRQ_STATS, "r");
+
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        sscanf(line, "deferred %lu", &val);
+    fclose(fp);
+    return val;
+}
+
+/* 返回发出的数据报数，失败返回0 */
+static unsigned long softirq_blast(unsigned int secs, size_t len)
+{
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    int rx, tx, small = 4096;
+    unsigned long sent = 0;
+    struct timeval start, now;
+    char *buf = calloc(1, len);
+
+    rx = socket(AF_INET, SOCK_DGRAM, 0);
+    tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!buf || rx < 0 || tx < 0)
+        goto out;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    if (bind(rx, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(rx, (struct sockaddr *)&addr, &alen))
+        goto out;
+
+    gettimeofday(&start, NULL);
+    do {
+        int i;
+
+        for (i = 0; i < 256; i++)
+            if (sendto(tx, buf, len, 0, (struct sockaddr *)&addr,
+                       sizeof(addr)) > 0)
+                sent++;
+        gettimeofday(&now, NULL);
+    } while (now.tv_sec - start.tv_sec < (long)secs);
+out:
+    if (rx >= 0)
+        close(rx);
+    if (tx >= 0)
+        close(tx);
+    free(buf);
+    return sent;
+}
+
+static int bench_softirq(int argc, char *argv[])
+{
+    unsigned int secs = argc > 2 ? strtoul(argv[2], NULL, 0) : SOFTIRQ_SECS;
+    size_t len = argc > 3 ? strtoul(argv[3], NULL, 0) : SOFTIRQ_DGRAM;
+    long hz = sysconf(_SC_CLK_TCK);
+    long old = sp_read(SOFTIRQ_DEFERRED);
+    int mode;
+
+    if (old < 0) {
+        fprintf(stderr, "softirq: %s not available\n", SOFTIRQ_DEFERRED);
+        return 1;
+    }
+    /* 先空跑一秒，让套接字缓存和路由都热起来，两轮的条件才相同 */
+    softirq_blast(1, len);
+    printf("deferred sent      softirq_ms  ms/10k   deferred_pages\n");
+    for (mode = 0; mode <= 1; mode++) {
+        unsigned long long t0, t1;
+        unsigned long d0, d1, sent;
+        double ms;
+
+        if (sp_write(SOFTIRQ_DEFERRED, mode)) {
+            fprintf(stderr, "softirq: cannot set %s\n", SOFTIRQ_DEFERRED);
+            return 1;
+        }
+        t0 = softirq_ticks();
+        d0 = softirq_deferred_pages();
+        sent = softirq_blast(secs, len);
+        t1 = softirq_ticks();
+        d1 = softirq_deferred_pages();
+        if (!sent) {
+            fprintf(stderr, "softirq: loopback UDP failed\n");
+            break;
+        }
+        ms = (t1 - t0) * 1000.0 / hz;
+        printf("%-8d %-10lu %-11.0f %-8.3f %lu\n", mode, sent, ms,
+               ms * 10000 / sent, d1 - d0);
+    }
+    sp_write(SOFTIRQ_DEFERRED, old);
+    return 0;
+}
+
+/*
+ * 1到3阶的多线程alloc/free配对基准。page_alloc/high_order_bench在每个
+ * 在线CPU上同时跑配对；这里分别在high_order_pcp为0和1时对每个阶各跑
+ * 一次，报告每对的纳秒数和加速比，结束后恢复原来的high_order_pcp。
+ * 用法："helloylt highorder [每线程次数]"。
+ */
+#define HO_BENCH_PATH   "/sys/kernel/debug/page_alloc/high_order_bench"
+#define HO_PCP_PATH     "/sys/kernel/debug/page_alloc/high_order_pcp"
+#define HO_LOOPS        100000
+
+static long ho_run(unsigned int order, unsigned long loops, int *threads,
+                   unsigned long *failed)
+{
+    char line[64];
+    long ns = -1;
+    FILE *fp = fopen(HO_BENCH_PATH, "w");
+
+    if (!fp)
+        return -1;
+    fprintf(fp, "%u %lu\n", order, loops);
+    if (fclose(fp))
+        return -1;
+    fp = fopen(HO_BENCH_PATH, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "threads %d", threads);
+        sscanf(line, "ns_per_pair %ld", &ns);
+        sscanf(line, "failed %lu", failed);
+    }
+    fclose(fp);
+    return ns;
+}
+
+static int bench_highorder(int argc, char *argv[])
+{
+    unsigned long loops = argc > 2 ? strtoul(argv[2], NULL, 0) : HO_LOOPS;
+    long old = sp_read(HO_PCP_PATH), ns[2][4];
+    unsigned long failed = 0;
+    int threads = 0, pcp, order, bad = 0;
+
+    if (old < 0) {
+        fprintf(stderr, "highorder: %s not available\n", HO_PCP_PATH);
+        return 1;
+    }
+    for (pcp = 0; pcp <= 1 && !bad; pcp++) {
+        if (sp_write(HO_PCP_PATH, pcp))
+            bad = 1;
+        for (order = 1; order <= 3 && !bad; order++) {
+            ns[pcp][order] = ho_run(order, loops, &threads, &failed);
+            if (ns[pcp][order] < 0)
+                bad = 1;
+        }
+    }
+    sp_write(HO_PCP_PATH, old);
+    if (bad) {
+        fprintf(stderr, "highorder: %s failed\n", HO_BENCH_PATH);
+        return 1;
+    }
+
+    printf("%d threads, %lu pairs each\n", threads, loops);
+    printf("order  zone->lock ns  pcp ns  speedup\n");
+    for (order = 1; order <= 3; order++)
+        printf("%5d  %13ld  %6ld  %.2fx\n", order, ns[0][order],
+               ns[1][order],
+               ns[1][order] > 0 ? (double)ns[0][order] / ns[1][order] : 0.0);
+    if (failed)
+        printf("warning: %lu allocations failed in the last run\n", failed);
+    return 0;
+}
+
+/*
+ * 竞争下的页面唤醒延迟。page_alloc/wait_bench让N个内核线程各自睡在
+ * 一个被锁住的页面上，再逐个解锁；这里按递增的N各跑一次，报告
+ * unlock_page()的耗时和平均/最大唤醒延迟，并附上各区等待表的桶数，
+ * 便于和wait_table_max=调整前后的结果对比。
+ * 用法："helloylt wakelat [等待者数...]"。
+ */
+#define WAIT_BENCH_PATH     "/sys/kernel/debug/page_alloc/wait_bench"
+#define WAIT_TABLES_PATH    "/sys/kernel/debug/page_alloc/wait_tables"
+
+static int wl_run(unsigned long waiters, unsigned long *ran, long *unlock_ns,
+                  long *wake_ns, long *wake_max)
+{
+    char line[64];
+    FILE *fp = fopen(WAIT_BENCH_PATH, "w");
+
+    if (!fp)
+        return -1;
+    fprintf(fp, "%lu\n", waiters);
+    if (fclose(fp))
+        return -1;
+    fp = fopen(WAIT_BENCH_PATH, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "waiters %lu", ran);
+        sscanf(line, "unlock_ns %ld", unlock_ns);
+        sscanf(line, "wake_ns %ld", wake_ns);
+        sscanf(line, "wake_max_ns %ld", wake_max);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int bench_wakelat(int argc, char *argv[])
+{
+    static const unsigned long def[] = { 16, 256, 1024, 4096 };
+    unsigned long waiters, ran, buckets, total = 0;
+    long unlock_ns, wake_ns, wake_max;
+    char line[128], zone[16];
+    int i, n = argc > 2 ? argc - 2 : (int)(sizeof(def) / sizeof(def[0]));
+    FILE *fp = fopen(WAIT_TABLES_PATH, "r");
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp))
+            if (sscanf(line, "%*d %15s %lu", zone, &buckets) == 2)
+                total += buckets;
+        fclose(fp);
+    }
+    printf("wait table buckets: %lu\n", total);
+    printf("waiters  unlock ns  wake ns  wake max ns\n");
+    for (i = 0; i < n; i++) {
+        waiters = argc > 2 ? strtoul(argv[i + 2], NULL, 0) : def[i];
+        ran = 0;
+        unlock_ns = wake_ns = wake_max = -1;
+        if (wl_run(waiters, &ran, &unlock_ns, &wake_ns, &wake_max)) {
+            fprintf(stderr, "wakelat: %s failed for %lu waiters\n",
+                    WAIT_BENCH_PATH, waiters);
+            return 1;
+        }
+        printf("%7lu  %9ld  %7ld  %11ld\n", ran, unlock_ns, wake_ns,
+               wake_max);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if (argc > 1 && strcmp(argv[1], "snapshot") == 0)
+        return show_snapshot(argc > 2 ? argv[2] : FA_SNAPSHOT_PATH);
+    if (argc > 1 && strcmp(argv[1], "locality") == 0)
+        return test_locality();
+    if (argc > 1 && strcmp(argv[1], "stripe") == 0)
+        return bench_stripe(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "freerange") == 0)
+        return bench_freerange(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "replay") == 0)
+        return replay_predict(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "pagecheck") == 0)
+        return show_pagecheck();
+    if (argc > 1 && strcmp(argv[1], "slowpath") == 0)
+        return test_slowpath(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "zero") == 0)
+        return show_zero();
+    if (argc > 1 && strcmp(argv[1], "softirq") == 0)
+        return bench_softirq(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "highorder") == 0)
+        return bench_highorder(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "wakelat") == 0)
+        return bench_wakelat(argc, argv);
 
-int main(){
     printf("MIPS Application------------------MIPS Application\n");
     printf("Hello YLT!\n");
 
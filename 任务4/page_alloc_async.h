@@ -0,0 +1,31 @@
+#ifndef _LINUX_PAGE_ALLOC_ASYNC_H
+#define _LINUX_PAGE_ALLOC_ASYNC_H
+
+/*
+ * page_alloc注释.c中异步页分配的接口。在内核树中这些声明放在
+ * include/linux/gfp.h里，这里单独列出，供驱动等调用者包含。
+ */
+#include <linux/list.h>
+#include <linux/gfp.h>
+
+struct page;
+
+/*
+ * 调用者填写gfp_mask、order、nid、deadline和complete，请求结构在完成
+ * 或被cancel_alloc_pages_async()取消之前必须保持有效。nid可以是
+ * NUMA_NO_NODE，表示提交请求的CPU所在的节点。deadline是jiffies。
+ */
+struct page_alloc_request {
+	struct list_head list;
+	gfp_t gfp_mask;
+	unsigned int order;
+	int nid;
+	unsigned long deadline;
+	void (*complete)(struct page_alloc_request *req, struct page *page);
+	struct page *page;
+};
+
+extern struct page *alloc_pages_async(struct page_alloc_request *req);
+extern bool cancel_alloc_pages_async(struct page_alloc_request *req);
+
+#endif /* _LINUX_PAGE_ALLOC_ASYNC_H */
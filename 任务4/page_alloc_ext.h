@@ -0,0 +1,48 @@
+#ifndef _LINUX_PAGE_ALLOC_EXT_H
+#define _LINUX_PAGE_ALLOC_EXT_H
+
+/*
+ * page_alloc注释.c中供mm内外其他文件调用的接口。在内核树中批量上线的
+ * 部分放在include/linux/memory_hotplug.h里。
+ */
+#include <linux/gfp.h>
+
+/*
+ * 页着色模式（page_colours=N）下分配一个pfn低位等于colour的0阶页面。
+ * 只是尽量满足：快速路径拿不到该颜色时退回相邻颜色或普通分配。
+ */
+extern struct page *alloc_page_colour(gfp_t gfp_mask, int nid,
+				      unsigned int colour);
+
+/*
+ * 把[start_pfn, end_pfn)分为空闲和在用两类，返回空闲页数。memory-failure
+ * 和hot-remove对整段范围用它代替逐页的is_free_buddy_page()。free_map
+ * 可以为NULL，否则每个空闲的pfn置一位。
+ */
+extern unsigned long classify_free_range(unsigned long start_pfn,
+					 unsigned long end_pfn,
+					 unsigned long *free_map);
+
+/*
+ * 启动之后重建的分区列表通过指针发布，pgdat->node_zonelists只保留启动
+ * 时的版本。需要最新列表的读者在zonelist_read_lock()和
+ * zonelist_read_unlock()之间用node_zonelist_live()代替node_zonelist()，
+ * idx是zonelist_read_lock()的返回值；临界区内可以睡眠。
+ */
+extern int zonelist_read_lock(void);
+extern void zonelist_read_unlock(int idx);
+extern struct zonelist *node_zonelist_live(int nid, gfp_t flags, int idx);
+
+#ifdef CONFIG_MEMORY_HOTPLUG
+/*
+ * online_pages()在online_page回调仍是generic_online_page()时，把
+ * online_pages_range_batched()代替online_pages_range()传给
+ * walk_system_ram_range()，对齐的MAX_ORDER块就整块上线。
+ */
+extern unsigned long online_pages_batched(unsigned long start_pfn,
+					  unsigned long nr_pages);
+extern int online_pages_range_batched(unsigned long start_pfn,
+				      unsigned long nr_pages, void *arg);
+#endif
+
+#endif /* _LINUX_PAGE_ALLOC_EXT_H */
@@ -0,0 +1,146 @@
+#ifndef _LINUX_PAGE_ALLOC_SHARED_H
+#define _LINUX_PAGE_ALLOC_SHARED_H
+
+/*
+ * page_alloc注释.c中与内核数据结构无关的计算，内核和用户态的
+ * 任务3/应用模块/helloylt共用同一份代码：helloylt用合成的输入检验
+ * 这些函数，而不是检验一份拷贝。这里只用C的基本类型，不包含任何头文件。
+ */
+
+#ifndef LOCAL_DISTANCE
+#define LOCAL_DISTANCE			10
+#endif
+#ifndef PENALTY_FOR_NODE_WITH_CPUS
+#define PENALTY_FOR_NODE_WITH_CPUS	1
+#endif
+
+/*
+ * 把实测的延迟换算成node_distance()的单位：remote / local * 10，四舍五入。
+ * 任一方向没有测量（为0）时使用@distance。
+ */
+static inline int pa_latency_locality(unsigned int local, unsigned int remote,
+				      int distance)
+{
+	if (!local || !remote)
+		return distance;
+	return (remote * LOCAL_DISTANCE + local / 2) / local;
+}
+
+/*
+ * find_next_best_node()中候选节点@n相对@node的代价，越小越优先：
+ * 访存代价，低于@node的节点罚1（"倾向于下一个节点"），有CPU的节点
+ * 罚PENALTY_FOR_NODE_WITH_CPUS，最后按@load_scale放大后加上节点的负载，
+ * 负载只在代价相同时起作用。
+ */
+static inline int pa_node_rank(int locality, int node, int n, int has_cpus,
+			       int load_scale, int load)
+{
+	int val = locality;
+
+	val += (n < node);
+	if (has_cpus)
+		val += PENALTY_FOR_NODE_WITH_CPUS;
+	return val * load_scale + load;
+}
+
+/*
+ * 空闲伙伴块的查询。调用者提供buddy_order(pfn, arg)：pfn是空闲块的头页
+ * 时返回块的阶，不是（或者pfn是空洞）时返回PA_NOT_BUDDY，pfn已经不在
+ * 正在查询的区里时返回PA_OTHER_ZONE。内核在zone->lock下调用。
+ */
+#define PA_NOT_BUDDY	(-1)
+#define PA_OTHER_ZONE	(-2)
+
+typedef int (*pa_buddy_order_t)(unsigned long pfn, void *arg);
+typedef void (*pa_mark_free_t)(unsigned long pfn, unsigned long nr, void *arg);
+
+/*
+ * 找到包含pfn的空闲块，返回块之后的第一个pfn；pfn不在空闲块中时返回0。
+ * 逐阶探测最多max_order个候选头页，和is_free_buddy_page()的做法相同。
+ */
+static inline unsigned long pa_free_block_end(unsigned long pfn, int max_order,
+					      pa_buddy_order_t buddy_order,
+					      void *arg)
+{
+	int order, o;
+
+	for (order = 0; order < max_order; order++) {
+		unsigned long head = pfn & ~((1UL << order) - 1);
+
+		o = buddy_order(head, arg);
+		if (o == PA_OTHER_ZONE)
+			break;
+		if (o >= order)
+			return head + (1UL << o);
+	}
+	return 0;
+}
+
+/*
+ * 从pfn走到end（不含）。block_end是pfn所在空闲块的结束pfn，不在空闲块
+ * 中时为0，由调用者用pa_free_block_end()求出。之后沿空闲块的头页按块
+ * 跳过：上一个pfn不在空闲块中，包含下一个pfn的空闲块只能从它开始，
+ * 所以每个pfn只探测一次。每段空闲页调用一次mark（可以为NULL），
+ * *nr_free累加空闲页数。遇到别的区时停下，返回停下的pfn。
+ */
+static inline unsigned long pa_walk_free_blocks(unsigned long pfn,
+				unsigned long end, unsigned long block_end,
+				pa_buddy_order_t buddy_order,
+				pa_mark_free_t mark, void *arg,
+				unsigned long *nr_free)
+{
+	int o;
+
+	while (pfn < end) {
+		if (block_end) {
+			if (block_end > end)
+				block_end = end;
+			if (mark)
+				mark(pfn, block_end - pfn, arg);
+			*nr_free += block_end - pfn;
+			pfn = block_end;
+			block_end = 0;
+			continue;
+		}
+
+		o = buddy_order(pfn, arg);
+		if (o == PA_OTHER_ZONE)
+			break;
+		if (o >= 0)
+			block_end = pfn + (1UL << o);
+		else
+			pfn++;
+	}
+	return pfn;
+}
+
+/*
+ * 确定性重放的判定，见page_alloc注释.c中的fail_replay说明。序号在
+ * 升序的schedule中，或者period非0且hash(序号^seed)落在[0, 2^32/period)
+ * 中时失败，平均每period个分配失败一个。哈希与内核的hash_32(val, 32)
+ * 相同；它的低位只是序号低位的置换，所以按高位取舍，不用取模。
+ * helloylt replay用它预先算出一轮测试中哪些分配会失败。
+ */
+static inline int pa_fail_replay_hit(unsigned int seed, unsigned int period,
+				     unsigned int index,
+				     const unsigned int *schedule, int nr)
+{
+	int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (schedule[mid] == index)
+			return 1;
+		if (schedule[mid] < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return period &&
+		((unsigned long long)((index ^ seed) * 0x9e370001U) * period
+		 >> 32) == 0;
+}
+
+#endif /* _LINUX_PAGE_ALLOC_SHARED_H */
@@ -58,10 +58,29 @@
 #include <linux/memcontrol.h>
 #include <linux/prefetch.h>
 #include <linux/page-debug-flags.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/nmi.h>
+#include <linux/proc_fs.h>
+#include <linux/hash.h>
+#include <linux/stacktrace.h>
+#include <linux/random.h>
+#include <linux/jhash.h>
+#include <linux/irq_work.h>
+#include <linux/kallsyms.h>
+#include <linux/timex.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/srcu.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
 #include "internal.h"
+#include "page_alloc_async.h"
+#include "page_alloc_ext.h"
+#include "page_alloc_shared.h"
 
 #ifdef CONFIG_USE_PERCPU_NUMA_NODE_ID
 DEFINE_PER_CPU(int, numa_node);
@@ -148,6 +167,8 @@ int pageblock_order __read_mostly;
 #endif
 
 static void __free_pages_ok(struct page *page, unsigned int order);
+static bool free_high_order_pcp(struct page *page, unsigned int order);
+static void note_atomic_reserve_demand(struct zone *zone, unsigned int order);
 
 /*
  * 在lowmem_reserve sysctl中使用256，32的结果。
@@ -228,6 +249,75 @@ static void set_pageblock_migratetype(struct page *page, int migratetype)
 
 bool oom_killer_disabled __read_mostly;
 
+/*
+ * MIGRATE_RESERVE最多能占用的页块数。启动时按min_wmark_pages算出的
+ * 部分最多2块，其余的由高阶原子分配的需求历史决定。
+ */
+#define MAX_MIGRATE_RESERVE_BLOCKS	8
+
+/*
+ * struct zone定义在mmzone.h中，分配器在本文件里额外维护的每区状态
+ * 放在这个旁路表中，以(节点号, 区号)为索引。
+ */
+struct zone_alloc_ext {
+	/* 当前被标记为MIGRATE_RESERVE的页块的起始pfn */
+	unsigned long reserve_pfn[MAX_MIGRATE_RESERVE_BLOCKS];
+	int nr_reserve;
+	/* 是否已经做过一次完整的区扫描，之后的调整只看reserve_pfn[] */
+	int reserve_scanned;
+	/*
+	 * 各阶高阶原子分配进入慢速路径（或被快速失败）的次数，随调整衰减。
+	 * 在各CPU的原子上下文中无锁累加，和工作项的衰减并发，所以是原子量
+	 */
+	atomic_long_t reserve_demand[MAX_ORDER];
+	/* 第order位置位表示free_area[order]中至少有一个空闲块 */
+	unsigned long free_order_mask;
+	/*
+	 * 本区在当前唤醒间隔内发出的kswapd唤醒：开始时间，以及已经
+	 * 请求过的最高阶和最低classzone，压在一个字里整体更新。
+	 * 见kswapd_wake_coalesce()。
+	 */
+	unsigned long kswapd_wake_state;
+	/* 1到PAGE_ALLOC_COSTLY_ORDER阶的每CPU缓存，见free_high_order_pcp() */
+	struct high_order_pcp __percpu *hpcp;
+	/* 页着色模式下按颜色分开的0阶每CPU链表，见free_colour_pcp() */
+	struct colour_pcp __percpu *cpcp;
+	/*
+	 * 最近一次发布的pcp batch/high及其代号，pcp_seen是各CPU已经
+	 * 应用到的代号。见pcp_config_publish()。
+	 */
+	seqcount_t pcp_seq;
+	unsigned int pcp_gen;
+	unsigned long pcp_batch;
+	unsigned long pcp_high;
+	unsigned int __percpu *pcp_seen;
+};
+
+static struct zone_alloc_ext zone_alloc_ext[MAX_NUMNODES][MAX_NR_ZONES];
+
+static inline struct zone_alloc_ext *zone_ext(struct zone *zone)
+{
+	return &zone_alloc_ext[zone_to_nid(zone)][zone_idx(zone)];
+}
+
+/*
+ * free_area[]中nr_free的增减都经过这两个函数，顺带维护free_order_mask。
+ * 调用时持有zone->lock；读者不加锁，只把它当作提示。
+ */
+static inline void area_add_free(struct zone *zone, struct free_area *area)
+{
+	if (!area->nr_free++)
+		__set_bit(area - zone->free_area,
+			  &zone_ext(zone)->free_order_mask);
+}
+
+static inline void area_del_free(struct zone *zone, struct free_area *area)
+{
+	if (!--area->nr_free)
+		__clear_bit(area - zone->free_area,
+			    &zone_ext(zone)->free_order_mask);
+}
+
 #ifdef CONFIG_DEBUG_VM
 static int page_outside_zone_boundaries(struct zone *zone, struct page *page)
 {
@@ -337,7 +427,18 @@ static void free_compound_page(struct page *page)
 	__free_pages_ok(page, compound_order(page));
 }
 
-void prep_compound_page(struct page *page, unsigned long order)
+/*
+ * 每个尾页的struct page都要写一遍。尾页是顺序访问的，提前几个预取下一批
+ * struct page的缓存行，让写操作不必等待逐行的缺失。
+ */
+#define COMPOUND_PREFETCH_STRIDE	8
+
+/*
+ * @counts_zero为真时，调用者保证尾页的_count已经为0（从伙伴系统分配、
+ * 并经过check_new_page()检查的页面），可以省掉一次写。
+ */
+static void __prep_compound_page(struct page *page, unsigned long order,
+				 bool counts_zero)
 {
 	int i;
 	int nr_pages = 1 << order;
@@ -347,18 +448,28 @@ void prep_compound_page(struct page *page, unsigned long order)
 	__SetPageHead(page);
 	for (i = 1; i < nr_pages; i++) {
 		struct page *p = page + i;
+
+		if (i + COMPOUND_PREFETCH_STRIDE < nr_pages)
+			prefetchw(p + COMPOUND_PREFETCH_STRIDE);
 		__SetPageTail(p);
-		set_page_count(p, 0);
+		if (!counts_zero)
+			set_page_count(p, 0);
 		p->first_page = page;
 	}
 }
 
+void prep_compound_page(struct page *page, unsigned long order)
+{
+	__prep_compound_page(page, order, false);
+}
+
 /* 如果改变了这个函数，更新 __split_huge_page_refcount */
 static int destroy_compound_page(struct page *page, unsigned long order)
 {
 	int i;
 	int nr_pages = 1 << order;
 	int bad = 0;
+	unsigned long mismatch = 0;
 
 	if (unlikely(compound_order(page) != order) ||
 	    unlikely(!PageHead(page))) {
@@ -368,23 +479,72 @@ static int destroy_compound_page(struct page *page, unsigned long order)
 
 	__ClearPageHead(page);
 
+	/* 先累积不一致，循环里不做分支；只在出错时再逐页报告 */
 	for (i = 1; i < nr_pages; i++) {
 		struct page *p = page + i;
 
-		if (unlikely(!PageTail(p) || (p->first_page != page))) {
+		if (i + COMPOUND_PREFETCH_STRIDE < nr_pages)
+			prefetchw(p + COMPOUND_PREFETCH_STRIDE);
+		mismatch |= (!PageTail(p)) |
+			    ((unsigned long)p->first_page ^ (unsigned long)page);
+		__ClearPageTail(p);
+	}
+
+	if (unlikely(mismatch)) {
+		int tail_bad = 0;
+
+		for (i = 1; i < nr_pages; i++) {
+			if (page[i].first_page != page) {
+				bad_page(page);
+				tail_bad++;
+			}
+		}
+		/* 尾标志已经清掉了，无法再定位缺少PG_tail的页，报告一次 */
+		if (!tail_bad) {
 			bad_page(page);
-			bad++;
+			tail_bad++;
 		}
-		__ClearPageTail(p);
+		bad += tail_bad;
 	}
 
 	return bad;
 }
 
+/*
+ * 清零一段线性映射中连续的页面而不把它们带进缓存。体系结构可以用
+ * 非临时存储（流式写）实现它并定义__HAVE_ARCH_CLEAR_PAGES_NOCACHE；
+ * 否则退回到逐页clear_page()。
+ */
+#ifndef __HAVE_ARCH_CLEAR_PAGES_NOCACHE
+static inline void clear_pages_nocache(void *addr, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		clear_page(addr + i * PAGE_SIZE);
+}
+#endif
+
 static inline void prep_zero_page(struct page *page, int order, gfp_t gfp_flags)
 {
 	int i;
 
+	/*
+	 * 低端内存的块在线性映射里是连续的，直接按地址清零，不必每页
+	 * 经过kmap_atomic。__GFP_COLD的调用者短时间内不会读这些页面，
+	 * 用不占缓存的方式清零，避免把别人的热数据挤出去。
+	 */
+	if (!PageHighMem(page)) {
+		void *addr = page_address(page);
+
+		if (gfp_flags & __GFP_COLD)
+			clear_pages_nocache(addr, 1 << order);
+		else
+			for (i = 0; i < (1 << order); i++)
+				clear_page(addr + i * PAGE_SIZE);
+		return;
+	}
+
 	/*
 	 * clear_highpage()将使用KM_USER0，所以使用__GFP_ZERO是错误的。
 	 *__GFP_HIGHMEM从硬中断或软中断上下文。
@@ -420,9 +580,106 @@ static inline void clear_page_guard_flag(struct page *page)
 {
 	__clear_bit(PAGE_DEBUG_FLAG_GUARD, &page->debug_flags);
 }
+
+/*
+ * 抽样的保护页模式。每次释放都取消映射、每次拆分都留保护页，开销大到
+ * 无法在生产环境中打开。debug_guardpage_sample=N时，每个CPU的每一阶
+ * 平均每N次才做一次：拆分时只有被抽中的伙伴成为保护页（并立即取消映射），
+ * 释放时只有被抽中的块取消映射。
+ * 两次抽样之间的间隔在[1, 2N]中随机选取，避免和分配模式同步。
+ *
+ * 被取消映射的页面记在一个按pfn索引的旁路位图里，分配时只有块中有
+ * 页面被记录过才重新映射并清掉记录，否则每次分配都要白白改一遍页表。
+ * 位图在core_initcall中分配，此前的取消映射没有记录，所以位图一开始
+ * 全部置位；超出位图范围的pfn（例如后来热插入的内存）总是重新映射。
+ * 多映射一次是无害的，反过来则会让分配者访问到不存在的页面。
+ */
+static u32 debug_guardpage_sample __read_mostly;
+
+static int __init debug_guardpage_sample_setup(char *buf)
+{
+	debug_guardpage_sample = simple_strtoul(buf, &buf, 0);
+	return 1;
+}
+__setup("debug_guardpage_sample=", debug_guardpage_sample_setup);
+
+static DEFINE_PER_CPU(unsigned int [MAX_ORDER], guardpage_countdown);
+
+static bool guardpage_sampled(unsigned int order)
+{
+	unsigned int *left;
+	bool sampled = true;
+
+	if (!debug_guardpage_sample)
+		return true;
+
+	left = &get_cpu_var(guardpage_countdown)[order];
+	if (*left && --*left)
+		sampled = false;
+	else
+		*left = random32() % (2 * debug_guardpage_sample) + 1;
+	put_cpu_var(guardpage_countdown);
+	return sampled;
+}
+
+static unsigned long *debug_unmapped_map __read_mostly;
+static unsigned long debug_unmapped_nr __read_mostly;
+
+static int __init debug_unmapped_init(void)
+{
+	unsigned long *map;
+
+	map = vmalloc(BITS_TO_LONGS(max_pfn) * sizeof(unsigned long));
+	if (!map) {
+		printk(KERN_WARNING "debug_pagealloc: cannot allocate "
+		       "unmapped page map, always remapping\n");
+		return -ENOMEM;
+	}
+	bitmap_fill(map, max_pfn);
+
+	debug_unmapped_nr = max_pfn;
+	smp_wmb();
+	debug_unmapped_map = map;
+	return 0;
+}
+core_initcall(debug_unmapped_init);
+
+/*
+ * 位图中的一个字可能覆盖属于不同拥有者的页面，所以用原子位操作；
+ * 只有抽中的取消映射和真正需要的重新映射才逐页改写位图。
+ */
+static void debug_unmap_pages(struct page *page, int nr)
+{
+	unsigned long *map = ACCESS_ONCE(debug_unmapped_map);
+	unsigned long pfn = page_to_pfn(page);
+	int i;
+
+	if (map && pfn + nr <= debug_unmapped_nr)
+		for (i = 0; i < nr; i++)
+			set_bit(pfn + i, map);
+	kernel_map_pages(page, nr, 0);
+}
+
+static void debug_remap_pages(struct page *page, int nr)
+{
+	unsigned long *map = ACCESS_ONCE(debug_unmapped_map);
+	unsigned long pfn = page_to_pfn(page);
+	int i;
+
+	if (map && pfn + nr <= debug_unmapped_nr) {
+		if (find_next_bit(map, pfn + nr, pfn) >= pfn + nr)
+			return;
+		for (i = 0; i < nr; i++)
+			clear_bit(pfn + i, map);
+	}
+	kernel_map_pages(page, nr, 1);
+}
 #else
 static inline void set_page_guard_flag(struct page *page) { }
 static inline void clear_page_guard_flag(struct page *page) { }
+static inline bool guardpage_sampled(unsigned int order) { return true; }
+static inline void debug_unmap_pages(struct page *page, int nr) { }
+static inline void debug_remap_pages(struct page *page, int nr) { }
 #endif
 
 static inline void set_page_order(struct page *page, int order)
@@ -553,7 +810,7 @@ static inline void __free_one_page(struct page *page,
 			__mod_zone_page_state(zone, NR_FREE_PAGES, 1 << order);
 		} else {
 			list_del(&buddy->lru);
-			zone->free_area[order].nr_free--;
+			area_del_free(zone, &zone->free_area[order]);
 			rmv_page_order(buddy);
 		}
 		combined_idx = buddy_idx & page_idx;
@@ -586,7 +843,7 @@ static inline void __free_one_page(struct page *page,
 
 	list_add(&page->lru, &zone->free_area[order].free_list[migratetype]);
 out:
-	zone->free_area[order].nr_free++;
+	area_add_free(zone, &zone->free_area[order]);
 }
 
 /*
@@ -615,6 +872,35 @@ static inline int free_pages_check(struct page *page)
 	return 0;
 }
 
+/*
+ * 有异步分配请求在排队时，成批释放或释放高阶块之后提前处理它们，
+ * 零散的0阶释放只靠ASYNC_ALLOC_POLL的轮询。见alloc_pages_async()。
+ *
+ * 释放路径可能在任意锁下执行，不能直接进入工作队列和唤醒代码，
+ * 所以只经irq_work转一手；async_alloc_kicked保证每一轮处理最多
+ * 排一次irq_work，其余释放者只读一下这两个变量。
+ */
+static atomic_t nr_async_alloc_pending = ATOMIC_INIT(0);
+static unsigned long async_alloc_kicked;
+static void async_alloc_process(struct work_struct *work);
+static DECLARE_WORK(async_alloc_kick_work, async_alloc_process);
+
+static void async_alloc_irq_work_fn(struct irq_work *work)
+{
+	schedule_work(&async_alloc_kick_work);
+}
+
+static struct irq_work async_alloc_irq_work = {
+	.func	= async_alloc_irq_work_fn,
+};
+
+static inline void async_alloc_kick(void)
+{
+	if (unlikely(atomic_read(&nr_async_alloc_pending)) &&
+	    !test_and_set_bit(0, &async_alloc_kicked))
+		irq_work_queue(&async_alloc_irq_work);
+}
+
 /*
  * 从PCP列表中释放一定数量的页面
  * 假设列表中的所有页面都在同一区域，且顺序相同。
@@ -669,6 +955,7 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 	}
 	__mod_zone_page_state(zone, NR_FREE_PAGES, count);
 	spin_unlock(&zone->lock);
+	async_alloc_kick();
 }
 
 static void free_one_page(struct zone *zone, struct page *page, int order,
@@ -681,160 +968,1006 @@ static void free_one_page(struct zone *zone, struct page *page, int order,
 	__free_one_page(page, zone, order, migratetype);
 	__mod_zone_page_state(zone, NR_FREE_PAGES, 1 << order);
 	spin_unlock(&zone->lock);
+	if (order)
+		async_alloc_kick();
 }
 
-static bool free_pages_prepare(struct page *page, unsigned int order)
-{
-	int i;
-	int bad = 0;
-
-	trace_mm_page_free(page, order);
-	kmemcheck_free_shadow(page, order);
-
-	if (PageAnon(page))
-		page->mapping = NULL;
-	for (i = 0; i < (1 << order); i++)
-		bad += free_pages_check(page + i);
-	if (bad)
-		return false;
+/*
+ * 高阶块的struct page检查级别。逐页调用free_pages_check()/check_new_page()
+ * 时每页都要分别判断_mapcount、mapping、_count和flags；高阶块上改为把
+ * 这些字必须为零的部分OR到一起，一次判断整个块，只有结果非零时才退回
+ * 逐页检查来找出并报告坏页。
+ *
+ * PAGE_CHECK_HEADTAIL只检查分配出去的块的头尾两页，适合生产环境；
+ * 释放时仍然要清除每页的PAGE_FLAGS_CHECK_AT_PREP，所以释放路径在这个
+ * 级别下按PAGE_CHECK_REDUCE处理。
+ */
+enum {
+	PAGE_CHECK_HEADTAIL,
+	PAGE_CHECK_REDUCE,
+	PAGE_CHECK_FULL,
+};
 
-	if (!PageHighMem(page)) {
-		debug_check_no_locks_freed(page_address(page),PAGE_SIZE<<order);
-		debug_check_no_obj_freed(page_address(page),
-					   PAGE_SIZE << order);
-	}
-	arch_free_page(page, order);
-	kernel_map_pages(page, 1 << order, 0);
+static u32 page_check_level __read_mostly = PAGE_CHECK_REDUCE;
 
-	return true;
+static int __init setup_page_check_level(char *str)
+{
+	page_check_level = simple_strtoul(str, &str, 0);
+	return 1;
 }
+__setup("page_check_level=", setup_page_check_level);
 
-static void __free_pages_ok(struct page *page, unsigned int order)
+/* 块内任何一页有不该出现的状态时返回非零 */
+static inline unsigned long page_range_reduce(struct page *page, int nr,
+					      unsigned long flags_mask)
 {
-	unsigned long flags;
-	int wasMlocked = __TestClearPageMlocked(page);
+	unsigned long acc = 0;
+	int i;
 
-	if (!free_pages_prepare(page, order))
-		return;
+	for (i = 0; i < nr; i++) {
+		struct page *p = page + i;
 
-	local_irq_save(flags);
-	if (unlikely(wasMlocked))
-		free_page_mlock(page);
-	__count_vm_events(PGFREE, 1 << order);
-	free_one_page(page_zone(page), page, order,
-					get_pageblock_migratetype(page));
-	local_irq_restore(flags);
+		acc |= (unsigned long)(atomic_read(&p->_mapcount) + 1) |
+		       (unsigned long)p->mapping |
+		       (unsigned long)atomic_read(&p->_count) |
+		       (p->flags & flags_mask) |
+		       mem_cgroup_bad_page_check(p);
+	}
+	return acc;
 }
 
-void __meminit __free_pages_bootmem(struct page *page, unsigned int order)
+static inline int __free_pages_check_range(struct page *page,
+					   unsigned int order, u32 level)
 {
-	unsigned int nr_pages = 1 << order;
-	unsigned int loop;
-
-	prefetchw(page);
-	for (loop = 0; loop < nr_pages; loop++) {
-		struct page *p = &page[loop];
+	int i, nr = 1 << order;
+	int bad = 0;
 
-		if (loop + 1 < nr_pages)
-			prefetchw(p + 1);
-		__ClearPageReserved(p);
-		set_page_count(p, 0);
+	if (order && level < PAGE_CHECK_FULL &&
+	    !page_range_reduce(page, nr, PAGE_FLAGS_CHECK_AT_FREE)) {
+		for (i = 0; i < nr; i++)
+			if (page[i].flags & PAGE_FLAGS_CHECK_AT_PREP)
+				page[i].flags &= ~PAGE_FLAGS_CHECK_AT_PREP;
+		return 0;
 	}
 
-	set_page_refcounted(page);
-	__free_pages(page, order);
+	for (i = 0; i < nr; i++)
+		bad += free_pages_check(page + i);
+	return bad;
 }
 
+static int free_pages_check_range(struct page *page, unsigned int order)
+{
+	return __free_pages_check_range(page, order, page_check_level);
+}
 
 /*
- * 这里的细分顺序对于IO子系统来说是至关重要的。
- * 如果没有充分的理由和回归测试，不能改变这个顺序。
- * 测试具体来说，当大的内存块被细分的时候
- * 较小的块被交付的顺序取决于
- * 它们在这个函数中被分割的顺序。这是最主要的因素
- * 影响页面被交付给IO的顺序
- * 根据经验测试，这是影响页面交付给IO子系统的顺序的主要因素，而且这也是合理的。
- * 通过考虑一个包含单一的
- * 考虑到一个伙伴系统的行为，其中包含一个由一系列小的分配所作用的大的内存块。
- * 这种行为是sglist合并成功的一个关键因素。
+ * 页面所有者跟踪。运行几周之后出现的内存泄漏，事后已经无法知道是谁
+ * 分配了这些页面。page_owner=1时，prep_new_page()在一个按pfn索引的
+ * 旁路数组中记下块首页的阶、gfp_mask、分配时间和调用栈句柄，
+ * free_pages_prepare()把它清掉；struct page本身不增加任何字段。
  *
- * --wli
+ * 调用栈放在一个只增不减的栈仓库中：按jhash去重，相同的栈只存一份，
+ * 旁路数组里只保存一个32位句柄，每页的开销是16字节。仓库的查找不加锁，
+ * 只有插入新栈时才拿page_owner_depot_lock。句柄0表示页面空闲；仓库
+ * 满了以后新出现的栈记为PAGE_OWNER_NO_STACK，页面仍然算作被占用，只是
+ * 没有调用栈。分配时间是启动以来的秒数，不受修改系统时间的影响。
+ * 旁路数组在core_initcall中分配，此前
+ * 分配的页面不被跟踪。没有CONFIG_STACKTRACE时无从记录调用栈，
+ * 整个功能不编译。
  */
-static inline void expand(struct zone *zone, struct page *page,
-	int low, int high, struct free_area *area,
-	int migratetype)
-{
-	unsigned long size = 1 << high;
+#ifdef CONFIG_STACKTRACE
+#define PAGE_OWNER_STACK_DEPTH	16
+#define PAGE_OWNER_STACK_SKIP	2
+#define PAGE_OWNER_HASH_BITS	12
+#define PAGE_OWNER_DEPOT_SIZE	(1UL << 20)
+/* 句柄是仓库内偏移加1，不会超过PAGE_OWNER_DEPOT_SIZE */
+#define PAGE_OWNER_NO_STACK	((u32)~0U)
+
+struct page_owner {
+	u32 handle;
+	u32 gfp_mask;
+	u32 timestamp;
+	u32 order;
+};
 
-	while (high > low) {
-		area--;
-		high--;
-		size >>= 1;
-		VM_BUG_ON(bad_range(zone, &page[size]));
+struct page_owner_stack {
+	struct page_owner_stack *next;
+	u32 hash;
+	u32 handle;
+	unsigned int nr_entries;
+	unsigned long entries[0];
+};
 
-#ifdef CONFIG_DEBUG_PAGEALLOC
-		if (high < debug_guardpage_minorder()) {
-			/*
-			 * 标记为保护页（或页面），这将使
-			 * 当伙伴将被释放时，合并回分配器。
-			 * 对应的页表项将不会被触动。
-			 * 页面将保持不存在于虚拟地址空间中
-			 */
-			INIT_LIST_HEAD(&page[size].lru);
-			set_page_guard_flag(&page[size]);
-			set_page_private(&page[size], high);
-			/* 守护页面不能用于任何用途 */
-			__mod_zone_page_state(zone, NR_FREE_PAGES, -(1 << high));
-			continue;
-		}
-#endif
-		list_add(&page[size].lru, &area->free_list[migratetype]);
-		area->nr_free++;
-		set_page_order(&page[size], high);
-	}
+static u32 page_owner __read_mostly;
+static struct page_owner *page_owner_table __read_mostly;
+static unsigned long page_owner_nr __read_mostly;
+
+static struct page_owner_stack *page_owner_hash[1 << PAGE_OWNER_HASH_BITS];
+static char *page_owner_depot;
+static unsigned long page_owner_depot_used;
+static unsigned long page_owner_depot_full;
+static DEFINE_SPINLOCK(page_owner_depot_lock);
+
+static int __init setup_page_owner(char *str)
+{
+	page_owner = simple_strtoul(str, &str, 0);
+	return 1;
 }
+__setup("page_owner=", setup_page_owner);
 
-/*
- * 这个页面即将从页面分配器返回
- */
-static inline int check_new_page(struct page *page)
+static int __init page_owner_init(void)
 {
-	if (unlikely(page_mapcount(page) |
-		(page->mapping != NULL)  |
-		(atomic_read(&page->_count) != 0)  |
-		(page->flags & PAGE_FLAGS_CHECK_AT_PREP) |
-		(mem_cgroup_bad_page_check(page)))) {
-		bad_page(page);
-		return 1;
+	struct page_owner *table;
+
+	if (!page_owner)
+		return 0;
+
+	page_owner_depot = vmalloc(PAGE_OWNER_DEPOT_SIZE);
+	table = vzalloc(max_pfn * sizeof(struct page_owner));
+	if (!page_owner_depot || !table) {
+		vfree(page_owner_depot);
+		vfree(table);
+		page_owner_depot = NULL;
+		printk(KERN_WARNING "page_owner: cannot allocate tables\n");
+		return -ENOMEM;
 	}
+
+	page_owner_nr = max_pfn;
+	smp_wmb();
+	page_owner_table = table;
+	printk(KERN_INFO "page_owner: tracking %lu pages, %lu KB\n",
+	       max_pfn, (max_pfn * sizeof(struct page_owner)) >> 10);
 	return 0;
 }
+core_initcall(page_owner_init);
 
-static int prep_new_page(struct page *page, int order, gfp_t gfp_flags)
+static inline struct page_owner_stack *page_owner_stack_at(u32 handle)
 {
-	int i;
+	return (struct page_owner_stack *)
+		(page_owner_depot + handle - 1);
+}
 
-	for (i = 0; i < (1 << order); i++) {
-		struct page *p = page + i;
-		if (unlikely(check_new_page(p)))
-			return 1;
+/* 返回去重后的栈句柄，仓库已满时返回PAGE_OWNER_NO_STACK */
+static u32 page_owner_save_stack(void)
+{
+	unsigned long entries[PAGE_OWNER_STACK_DEPTH];
+	struct stack_trace trace = {
+		.max_entries	= PAGE_OWNER_STACK_DEPTH,
+		.entries	= entries,
+		.skip		= PAGE_OWNER_STACK_SKIP,
+	};
+	struct page_owner_stack *s, **bucket;
+	unsigned long flags;
+	size_t size;
+	u32 hash;
+
+	save_stack_trace(&trace);
+	if (trace.nr_entries &&
+	    entries[trace.nr_entries - 1] == ULONG_MAX)
+		trace.nr_entries--;
+
+	hash = jhash2((u32 *)entries,
+		      trace.nr_entries * sizeof(unsigned long) / sizeof(u32),
+		      0);
+	bucket = &page_owner_hash[hash >> (32 - PAGE_OWNER_HASH_BITS)];
+
+	/* 插入者用smp_wmb()发布新节点，这里的无锁遍历总能看到完整的节点 */
+	for (s = ACCESS_ONCE(*bucket); s; s = ACCESS_ONCE(s->next)) {
+		smp_read_barrier_depends();
+		if (s->hash == hash && s->nr_entries == trace.nr_entries &&
+		    !memcmp(s->entries, entries,
+			    trace.nr_entries * sizeof(unsigned long)))
+			return s->handle;
 	}
 
-	set_page_private(page, 0);
-	set_page_refcounted(page);
-
-	arch_alloc_page(page, order);
-	kernel_map_pages(page, 1 << order, 1);
-
-	if (gfp_flags & __GFP_ZERO)
-		prep_zero_page(page, order, gfp_flags);
+	size = sizeof(*s) + trace.nr_entries * sizeof(unsigned long);
+	size = ALIGN(size, sizeof(unsigned long));
 
-	if (order && (gfp_flags & __GFP_COMP))
-		prep_compound_page(page, order);
+	spin_lock_irqsave(&page_owner_depot_lock, flags);
+	/* 拿锁期间可能有别人插入了同样的栈 */
+	for (s = *bucket; s; s = s->next) {
+		if (s->hash == hash && s->nr_entries == trace.nr_entries &&
+		    !memcmp(s->entries, entries,
+			    trace.nr_entries * sizeof(unsigned long)))
+			goto out;
+	}
+	if (page_owner_depot_used + size > PAGE_OWNER_DEPOT_SIZE) {
+		page_owner_depot_full++;
+		spin_unlock_irqrestore(&page_owner_depot_lock, flags);
+		return PAGE_OWNER_NO_STACK;
+	}
+	s = (struct page_owner_stack *)(page_owner_depot +
+					page_owner_depot_used);
+	s->handle = page_owner_depot_used + 1;
+	page_owner_depot_used += size;
+	s->hash = hash;
+	s->nr_entries = trace.nr_entries;
+	memcpy(s->entries, entries, trace.nr_entries * sizeof(unsigned long));
+	s->next = *bucket;
+	smp_wmb();
+	*bucket = s;
+out:
+	spin_unlock_irqrestore(&page_owner_depot_lock, flags);
+	return s->handle;
+}
 
-	return 0;
+static inline u32 page_owner_now(void)
+{
+	return div_u64(get_jiffies_64(), HZ);
 }
 
+static inline struct page_owner *page_owner_lookup(struct page *page)
+{
+	struct page_owner *table = ACCESS_ONCE(page_owner_table);
+	unsigned long pfn = page_to_pfn(page);
+
+	if (!table || pfn >= page_owner_nr)
+		return NULL;
+	return table + pfn;
+}
+
+static inline void set_page_owner(struct page *page, int order,
+				  gfp_t gfp_mask)
+{
+	struct page_owner *po;
+
+	if (likely(!page_owner))
+		return;
+	po = page_owner_lookup(page);
+	if (!po)
+		return;
+
+	po->order = order;
+	po->gfp_mask = gfp_mask;
+	po->timestamp = page_owner_now();
+	po->handle = page_owner_save_stack();
+}
+
+static inline void reset_page_owner(struct page *page)
+{
+	struct page_owner *po;
+
+	if (likely(!page_owner))
+		return;
+	po = page_owner_lookup(page);
+	if (po)
+		po->handle = 0;
+}
+
+/* split_page()之后每个子页单独释放，把首页的记录复制成0阶记录 */
+static void split_page_owner(struct page *page, unsigned int order)
+{
+	struct page_owner *po;
+	int i;
+
+	if (likely(!page_owner))
+		return;
+	po = page_owner_lookup(page);
+	if (!po || !po->handle ||
+	    page_to_pfn(page) + (1 << order) > page_owner_nr)
+		return;
+
+	po->order = 0;
+	for (i = 1; i < (1 << order); i++)
+		po[i] = po[0];
+}
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * 按调用栈汇总当前仍被占用的页面：打开文件时逐个扫描一遍旁路数组，
+ * 不拿任何锁，结果只是一个近似的快照；之后的读取只是在汇总结果上
+ * 逐条迭代，缓冲区不够时也不会重新扫描。按页数从多到少输出，每个栈
+ * 附带最早一次分配距今的秒数，长期不释放的栈最值得怀疑。仓库满后
+ * 分配的页面归在一个没有调用栈的条目下。
+ */
+#define PAGE_OWNER_SUMMARY_BITS	11
+#define PAGE_OWNER_SUMMARY	(1 << PAGE_OWNER_SUMMARY_BITS)
+
+struct page_owner_sum {
+	u32 handle;
+	u32 oldest;
+	unsigned long blocks;
+	unsigned long pages;
+};
+
+struct page_owner_iter {
+	int nr;
+	unsigned long dropped;
+	unsigned long now;
+	struct page_owner_sum sum[PAGE_OWNER_SUMMARY];
+};
+
+static int cmp_page_owner_sum(const void *a, const void *b)
+{
+	const struct page_owner_sum *x = a, *y = b;
+
+	return x->pages < y->pages ? 1 : x->pages > y->pages ? -1 : 0;
+}
+
+static void page_owner_summarize(struct page_owner_iter *it,
+				 struct page_owner *table)
+{
+	struct page_owner_sum *sum = it->sum;
+	unsigned long pfn;
+	int i, j;
+
+	/* 以句柄为键的开放寻址表，最多装一半，保证探测很快结束 */
+	for (pfn = 0; pfn < page_owner_nr; pfn++) {
+		struct page_owner po = table[pfn];
+
+		if (!(pfn & (MAX_ORDER_NR_PAGES - 1)))
+			cond_resched();
+		if (!po.handle)
+			continue;
+
+		i = hash_32(po.handle, PAGE_OWNER_SUMMARY_BITS);
+		while (sum[i].handle && sum[i].handle != po.handle)
+			i = (i + 1) & (PAGE_OWNER_SUMMARY - 1);
+		if (!sum[i].handle) {
+			if (it->nr == PAGE_OWNER_SUMMARY / 2) {
+				it->dropped += 1UL << po.order;
+				continue;
+			}
+			sum[i].handle = po.handle;
+			sum[i].oldest = po.timestamp;
+			it->nr++;
+		}
+		sum[i].blocks++;
+		sum[i].pages += 1UL << po.order;
+		if ((s32)(po.timestamp - sum[i].oldest) < 0)
+			sum[i].oldest = po.timestamp;
+	}
+
+	for (i = 0, j = 0; i < PAGE_OWNER_SUMMARY; i++)
+		if (sum[i].handle)
+			sum[j++] = sum[i];
+	sort(sum, it->nr, sizeof(*sum), cmp_page_owner_sum, NULL);
+}
+
+/* 第0..nr-1项是各个栈，第nr项是末尾的统计行 */
+static void *page_owner_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct page_owner_iter *it = m->private;
+
+	return *pos <= it->nr ? it->sum + *pos : NULL;
+}
+
+static void *page_owner_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return page_owner_seq_start(m, pos);
+}
+
+static void page_owner_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int page_owner_seq_show(struct seq_file *m, void *v)
+{
+	struct page_owner_iter *it = m->private;
+	struct page_owner_sum *sum = v;
+	struct page_owner_stack *s;
+	int j;
+
+	if (sum == it->sum + it->nr) {
+		seq_printf(m, "depot_used %lu depot_full %lu "
+			   "untracked_pages %lu\n",
+			   page_owner_depot_used, page_owner_depot_full,
+			   it->dropped);
+		return 0;
+	}
+
+	seq_printf(m, "%lu pages in %lu blocks, oldest %lus ago\n",
+		   sum->pages, sum->blocks, it->now - sum->oldest);
+	if (sum->handle == PAGE_OWNER_NO_STACK) {
+		seq_puts(m, "  (stack depot full)\n\n");
+		return 0;
+	}
+	s = page_owner_stack_at(sum->handle);
+	for (j = 0; j < s->nr_entries; j++)
+		seq_printf(m, "  %pS\n", (void *)s->entries[j]);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations page_owner_seq_ops = {
+	.start	= page_owner_seq_start,
+	.next	= page_owner_seq_next,
+	.stop	= page_owner_seq_stop,
+	.show	= page_owner_seq_show,
+};
+
+static int page_owner_open(struct inode *inode, struct file *file)
+{
+	struct page_owner *table = ACCESS_ONCE(page_owner_table);
+	struct page_owner_iter *it;
+	int ret;
+
+	if (!table)
+		return -ENODEV;
+
+	it = vzalloc(sizeof(*it));
+	if (!it)
+		return -ENOMEM;
+	it->now = page_owner_now();
+	page_owner_summarize(it, table);
+
+	ret = seq_open(file, &page_owner_seq_ops);
+	if (ret) {
+		vfree(it);
+		return ret;
+	}
+	((struct seq_file *)file->private_data)->private = it;
+	return 0;
+}
+
+static int page_owner_release(struct inode *inode, struct file *file)
+{
+	vfree(((struct seq_file *)file->private_data)->private);
+	return seq_release(inode, file);
+}
+
+static const struct file_operations page_owner_fops = {
+	.open		= page_owner_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= page_owner_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+#else /* CONFIG_STACKTRACE */
+
+static inline void set_page_owner(struct page *page, int order,
+				  gfp_t gfp_mask)
+{
+}
+
+static inline void reset_page_owner(struct page *page)
+{
+}
+
+static inline void split_page_owner(struct page *page, unsigned int order)
+{
+}
+#endif /* CONFIG_STACKTRACE */
+
+static bool free_pages_prepare(struct page *page, unsigned int order)
+{
+	trace_mm_page_free(page, order);
+	kmemcheck_free_shadow(page, order);
+
+	if (PageAnon(page))
+		page->mapping = NULL;
+	if (free_pages_check_range(page, order))
+		return false;
+
+	reset_page_owner(page);
+	if (!PageHighMem(page)) {
+		debug_check_no_locks_freed(page_address(page),PAGE_SIZE<<order);
+		debug_check_no_obj_freed(page_address(page),
+					   PAGE_SIZE << order);
+	}
+	arch_free_page(page, order);
+	if (guardpage_sampled(order))
+		debug_unmap_pages(page, 1 << order);
+
+	return true;
+}
+
+/*
+ * 高阶页面的延迟释放。网络软中断等上下文释放高阶页面时，要为每个子页
+ * 做free_pages_prepare()，再拿zone->lock合并伙伴，这些开销全算在释放者
+ * 头上。deferred_free=1时，中断上下文中释放的order>0页面只挂到本CPU的
+ * 队列上，由工作项在进程上下文中成批释放：连续属于同一个区的页面只拿
+ * 一次zone->lock。队列中的页数达到deferred_free_batch时立即唤醒工作项，
+ * 否则最多延迟一个jiffy。drain_all_pages()在发IPI之前，先在调用者的
+ * 进程上下文中清空各CPU的队列，所以直接回收后的drain_all_pages()能拿回
+ * 这些页面；drain_pages()本身在IPI里运行，不碰这个队列。
+ *
+ * 清空时每个关中断、持有zone->lock的区间最多释放DEFERRED_FREE_CHUNK个块，
+ * 队列再长也不会长时间关中断。
+ */
+#define DEFERRED_FREE_CHUNK	32
+
+struct deferred_free_queue {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned long nr_pages;
+	/* 统计 */
+	unsigned long deferred;
+	unsigned long flushes;
+	unsigned long lock_holds;
+};
+
+static DEFINE_PER_CPU(struct deferred_free_queue, deferred_free_queue);
+static u32 deferred_free __read_mostly;
+static u32 deferred_free_batch __read_mostly = 256;
+
+static int __init setup_deferred_free(char *str)
+{
+	deferred_free = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("deferred_free=", setup_deferred_free);
+
+static void deferred_free_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(deferred_free_work, deferred_free_work_fn);
+static DECLARE_WORK(deferred_free_kick, deferred_free_work_fn);
+
+static int __init deferred_free_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct deferred_free_queue *q = &per_cpu(deferred_free_queue, cpu);
+
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->list);
+	}
+	return 0;
+}
+early_initcall(deferred_free_init);
+
+static bool defer_free_pages(struct page *page, unsigned int order,
+			     int wasMlocked)
+{
+	struct deferred_free_queue *q;
+	unsigned long flags;
+	bool kick;
+
+	if (!deferred_free || !order || !in_interrupt())
+		return false;
+
+	local_irq_save(flags);
+	q = &__get_cpu_var(deferred_free_queue);
+	/* deferred_free_init()之前的释放照常进行 */
+	if (unlikely(!q->list.next)) {
+		local_irq_restore(flags);
+		return false;
+	}
+	if (unlikely(wasMlocked))
+		free_page_mlock(page);
+	spin_lock(&q->lock);
+	set_page_private(page, order);
+	list_add_tail(&page->lru, &q->list);
+	q->nr_pages += 1 << order;
+	q->deferred++;
+	kick = q->nr_pages >= deferred_free_batch;
+	spin_unlock(&q->lock);
+	local_irq_restore(flags);
+
+	if (kick)
+		schedule_work(&deferred_free_kick);
+	else
+		schedule_delayed_work(&deferred_free_work, 1);
+	return true;
+}
+
+/* 释放一个CPU队列中的全部页面，可以在任意CPU上调用 */
+static void deferred_free_flush_cpu(int cpu)
+{
+	struct deferred_free_queue *q = &per_cpu(deferred_free_queue, cpu);
+	struct zone *locked = NULL;
+	struct page *page, *next;
+	unsigned long flags, holds = 0;
+	LIST_HEAD(pages);
+
+	if (!q->nr_pages)
+		return;
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_splice_init(&q->list, &pages);
+	q->nr_pages = 0;
+	q->flushes++;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	/* 检查和取消映射不需要zone->lock，先全部做完；坏页照旧被丢弃 */
+	list_for_each_entry_safe(page, next, &pages, lru) {
+		if (!free_pages_prepare(page, page_private(page)))
+			list_del(&page->lru);
+	}
+
+	while (!list_empty(&pages)) {
+		int nr = 0;
+
+		local_irq_save(flags);
+		list_for_each_entry_safe(page, next, &pages, lru) {
+			unsigned int order = page_private(page);
+			struct zone *zone = page_zone(page);
+
+			if (nr++ == DEFERRED_FREE_CHUNK)
+				break;
+			list_del(&page->lru);
+			set_page_private(page, 0);
+			if (zone != locked) {
+				if (locked)
+					spin_unlock(&locked->lock);
+				spin_lock(&zone->lock);
+				zone->all_unreclaimable = 0;
+				zone->pages_scanned = 0;
+				locked = zone;
+				holds++;
+			}
+			__free_one_page(page, zone, order,
+					get_pageblock_migratetype(page));
+			__mod_zone_page_state(zone, NR_FREE_PAGES, 1 << order);
+			__count_vm_events(PGFREE, 1 << order);
+		}
+		if (locked)
+			spin_unlock(&locked->lock);
+		locked = NULL;
+		local_irq_restore(flags);
+	}
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->lock_holds += holds;
+	spin_unlock_irqrestore(&q->lock, flags);
+	async_alloc_kick();
+}
+
+static void deferred_free_work_fn(struct work_struct *work)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		deferred_free_flush_cpu(cpu);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int deferred_free_show(struct seq_file *m, void *arg)
+{
+	unsigned long queued = 0, deferred = 0, flushes = 0, holds = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct deferred_free_queue *q = &per_cpu(deferred_free_queue, cpu);
+
+		queued += q->nr_pages;
+		deferred += q->deferred;
+		flushes += q->flushes;
+		holds += q->lock_holds;
+	}
+	seq_printf(m, "queued_pages %lu\ndeferred     %lu\n"
+		   "flushes      %lu\nlock_holds   %lu\n",
+		   queued, deferred, flushes, holds);
+	return 0;
+}
+
+static int deferred_free_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, deferred_free_show, NULL);
+}
+
+static const struct file_operations deferred_free_fops = {
+	.open		= deferred_free_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
+static void __free_pages_ok(struct page *page, unsigned int order)
+{
+	unsigned long flags;
+	int wasMlocked = __TestClearPageMlocked(page);
+
+	if (defer_free_pages(page, order, wasMlocked))
+		return;
+
+	if (!free_pages_prepare(page, order))
+		return;
+
+	local_irq_save(flags);
+	if (unlikely(wasMlocked))
+		free_page_mlock(page);
+	__count_vm_events(PGFREE, 1 << order);
+	if (!free_high_order_pcp(page, order))
+		free_one_page(page_zone(page), page, order,
+					get_pageblock_migratetype(page));
+	local_irq_restore(flags);
+}
+
+void __meminit __free_pages_bootmem(struct page *page, unsigned int order)
+{
+	unsigned int nr_pages = 1 << order;
+	unsigned int loop;
+
+	prefetchw(page);
+	for (loop = 0; loop < nr_pages; loop++) {
+		struct page *p = &page[loop];
+
+		if (loop + 1 < nr_pages)
+			prefetchw(p + 1);
+		__ClearPageReserved(p);
+		set_page_count(p, 0);
+	}
+
+	set_page_refcounted(page);
+	__free_pages(page, order);
+}
+
+
+/*
+ * 这里的细分顺序对于IO子系统来说是至关重要的。
+ * 如果没有充分的理由和回归测试，不能改变这个顺序。
+ * 测试具体来说，当大的内存块被细分的时候
+ * 较小的块被交付的顺序取决于
+ * 它们在这个函数中被分割的顺序。这是最主要的因素
+ * 影响页面被交付给IO的顺序
+ * 根据经验测试，这是影响页面交付给IO子系统的顺序的主要因素，而且这也是合理的。
+ * 通过考虑一个包含单一的
+ * 考虑到一个伙伴系统的行为，其中包含一个由一系列小的分配所作用的大的内存块。
+ * 这种行为是sglist合并成功的一个关键因素。
+ *
+ * --wli
+ */
+static inline void expand(struct zone *zone, struct page *page,
+	int low, int high, struct free_area *area,
+	int migratetype)
+{
+	unsigned long size = 1 << high;
+
+	while (high > low) {
+		area--;
+		high--;
+		size >>= 1;
+		VM_BUG_ON(bad_range(zone, &page[size]));
+
+#ifdef CONFIG_DEBUG_PAGEALLOC
+		if (high < debug_guardpage_minorder() &&
+		    guardpage_sampled(high)) {
+			/*
+			 * 标记为保护页（或页面），这将使
+			 * 当伙伴将被释放时，合并回分配器。
+			 * 对应的页表项将不会被触动。
+			 * 页面将保持不存在于虚拟地址空间中
+			 */
+			INIT_LIST_HEAD(&page[size].lru);
+			set_page_guard_flag(&page[size]);
+			set_page_private(&page[size], high);
+			/* 守护页面不能用于任何用途 */
+			__mod_zone_page_state(zone, NR_FREE_PAGES, -(1 << high));
+			/* 抽样模式下空闲页面不一定已被取消映射 */
+			if (debug_guardpage_sample)
+				debug_unmap_pages(&page[size], 1 << high);
+			continue;
+		}
+#endif
+		list_add(&page[size].lru, &area->free_list[migratetype]);
+		area_add_free(zone, area);
+		set_page_order(&page[size], high);
+	}
+}
+
+/*
+ * 这个页面即将从页面分配器返回
+ */
+static inline int check_new_page(struct page *page)
+{
+	if (unlikely(page_mapcount(page) |
+		(page->mapping != NULL)  |
+		(atomic_read(&page->_count) != 0)  |
+		(page->flags & PAGE_FLAGS_CHECK_AT_PREP) |
+		(mem_cgroup_bad_page_check(page)))) {
+		bad_page(page);
+		return 1;
+	}
+	return 0;
+}
+
+static inline int __check_new_pages(struct page *page, int order, u32 level)
+{
+	int i, nr = 1 << order;
+
+	if (order && level == PAGE_CHECK_HEADTAIL) {
+		if (!page_range_reduce(page, 1, PAGE_FLAGS_CHECK_AT_PREP) &&
+		    !page_range_reduce(page + nr - 1, 1,
+				       PAGE_FLAGS_CHECK_AT_PREP))
+			return 0;
+	} else if (order && level == PAGE_CHECK_REDUCE) {
+		if (!page_range_reduce(page, nr, PAGE_FLAGS_CHECK_AT_PREP))
+			return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct page *p = page + i;
+		if (unlikely(check_new_page(p)))
+			return 1;
+	}
+	return 0;
+}
+
+static int check_new_pages(struct page *page, int order)
+{
+	return __check_new_pages(page, order, page_check_level);
+}
+
+static int prep_new_page(struct page *page, int order, gfp_t gfp_flags)
+{
+	if (check_new_pages(page, order))
+		return 1;
+
+	set_page_private(page, 0);
+	set_page_refcounted(page);
+
+	arch_alloc_page(page, order);
+	debug_remap_pages(page, 1 << order);
+
+	if (gfp_flags & __GFP_ZERO)
+		prep_zero_page(page, order, gfp_flags);
+
+	/* 只检查了头尾两页时，不能假定中间各页的_count为0 */
+	if (order && (gfp_flags & __GFP_COMP))
+		__prep_compound_page(page, order,
+				     page_check_level != PAGE_CHECK_HEADTAIL);
+
+	set_page_owner(page, order, gfp_flags);
+	return 0;
+}
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * page_alloc/page_check_cycles：读取时对0到PAGE_CHECK_BENCH_ORDER的每个
+ * 阶分配一个块，在各检查级别下重复运行分配和释放两侧的检查，报告每个
+ * 块平均的周期数（get_cycles()）。释放一侧的HEADTAIL级别按REDUCE处理，
+ * 不单独列出。测量期间头页的_count临时清零，块的状态和刚从伙伴系统
+ * 取出时相同，检查都应当通过；有检查失败时返回-EIO。
+ */
+#define PAGE_CHECK_BENCH_ORDER	min(MAX_ORDER - 1, 9)
+#define PAGE_CHECK_BENCH_LOOPS	64
+
+static unsigned long page_check_cycles(struct page *page, int order,
+				       u32 level, bool free_side, int *bad)
+{
+	unsigned long flags;
+	cycles_t start, end;
+	int i;
+
+	local_irq_save(flags);
+	start = get_cycles();
+	for (i = 0; i < PAGE_CHECK_BENCH_LOOPS; i++) {
+		if (free_side)
+			*bad |= __free_pages_check_range(page, order, level);
+		else
+			*bad |= __check_new_pages(page, order, level);
+	}
+	end = get_cycles();
+	local_irq_restore(flags);
+
+	return (unsigned long)(end - start) / PAGE_CHECK_BENCH_LOOPS;
+}
+
+static int page_check_cycles_show(struct seq_file *m, void *arg)
+{
+	int order, bad = 0;
+
+	seq_printf(m, "order %10s %10s %10s %10s %10s\n", "new_ht",
+		   "new_reduce", "new_full", "free_reduce", "free_full");
+	for (order = 0; order <= PAGE_CHECK_BENCH_ORDER && !bad; order++) {
+		struct page *page = alloc_pages(GFP_KERNEL | __GFP_NOWARN,
+						order);
+		unsigned long c[5];
+
+		if (!page)
+			break;
+		set_page_count(page, 0);
+		c[0] = page_check_cycles(page, order, PAGE_CHECK_HEADTAIL,
+					 false, &bad);
+		c[1] = page_check_cycles(page, order, PAGE_CHECK_REDUCE,
+					 false, &bad);
+		c[2] = page_check_cycles(page, order, PAGE_CHECK_FULL,
+					 false, &bad);
+		c[3] = page_check_cycles(page, order, PAGE_CHECK_REDUCE,
+					 true, &bad);
+		c[4] = page_check_cycles(page, order, PAGE_CHECK_FULL,
+					 true, &bad);
+		set_page_count(page, 1);
+		__free_pages(page, order);
+		if (!bad)
+			seq_printf(m, "%5d %10lu %10lu %10lu %10lu %10lu\n",
+				   order, c[0], c[1], c[2], c[3], c[4]);
+		cond_resched();
+	}
+	return bad ? -EIO : 0;
+}
+
+static int page_check_cycles_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, page_check_cycles_show, NULL);
+}
+
+static const struct file_operations page_check_cycles_fops = {
+	.open		= page_check_cycles_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * page_alloc/zero_bench：对几个阶各分配一个低端内存块，分别用普通清零
+ * 和__GFP_COLD（clear_pages_nocache()）调用prep_zero_page()，报告清零
+ * 的吞吐量，以及清零之后重新读一遍ZERO_BENCH_HOT大小的热缓冲区所需的
+ * 时间，与清零之前读它的时间之差就是清零挤出缓存造成的污染。没有定义
+ * __HAVE_ARCH_CLEAR_PAGES_NOCACHE的体系结构上两种方式是同一个循环，
+ * 数字应当相同。
+ */
+#define ZERO_BENCH_HOT		(256 << 10)
+#define ZERO_BENCH_LOOPS	8
+
+static const int zero_bench_orders[] = { 0, 3, 6, 9 };
+
+static u64 zero_bench_walk(const char *hot)
+{
+	unsigned long i;
+	u64 start = local_clock();
+
+	for (i = 0; i < ZERO_BENCH_HOT; i += L1_CACHE_BYTES)
+		(void)ACCESS_ONCE(hot[i]);
+	return local_clock() - start;
+}
+
+static int zero_bench_show(struct seq_file *m, void *arg)
+{
+	char *hot;
+	int i, cold, loop;
+
+	hot = kmalloc(ZERO_BENCH_HOT, GFP_KERNEL);
+	if (!hot)
+		return -ENOMEM;
+	memset(hot, 1, ZERO_BENCH_HOT);
+
+	seq_printf(m, "order mode    MB/s       hot_before_ns hot_after_ns\n");
+	for (i = 0; i < ARRAY_SIZE(zero_bench_orders); i++) {
+		int order = zero_bench_orders[i];
+		struct page *page;
+
+		if (order >= MAX_ORDER)
+			continue;
+		page = alloc_pages(GFP_KERNEL | __GFP_NOWARN, order);
+		if (!page)
+			continue;
+
+		for (cold = 0; cold <= 1; cold++) {
+			u64 zero_ns = 0, before = 0, after = 0, t;
+
+			for (loop = 0; loop < ZERO_BENCH_LOOPS; loop++) {
+				preempt_disable();
+				zero_bench_walk(hot);
+				before += zero_bench_walk(hot);
+				t = local_clock();
+				prep_zero_page(page, order,
+					       cold ? __GFP_COLD : 0);
+				zero_ns += local_clock() - t;
+				after += zero_bench_walk(hot);
+				preempt_enable();
+				cond_resched();
+			}
+			seq_printf(m, "%5d %-7s %-10llu %-13llu %llu\n", order,
+				   cold ? "nocache" : "cached",
+				   div64_u64((u64)ZERO_BENCH_LOOPS *
+					     (PAGE_SIZE << order) * 1000,
+					     max_t(u64, zero_ns, 1)),
+				   div_u64(before, ZERO_BENCH_LOOPS),
+				   div_u64(after, ZERO_BENCH_LOOPS));
+		}
+		__free_pages(page, order);
+	}
+	kfree(hot);
+	return 0;
+}
+
+static int zero_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zero_bench_show, NULL);
+}
+
+static const struct file_operations zero_bench_fops = {
+	.open		= zero_bench_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  * 浏览给定migratetype的自由列表，并从自由列表中删除
  * 从自由列表中删除最小的可用页面
@@ -857,7 +1990,7 @@ struct page *__rmqueue_smallest(struct zone *zone, unsigned int order,
 							struct page, lru);
 		list_del(&page->lru);
 		rmv_page_order(page);
-		area->nr_free--;
+		area_del_free(zone, area);
 		expand(zone, page, order, current_order, area, migratetype);
 		return page;
 	}
@@ -982,7 +2115,7 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 
 			page = list_entry(area->free_list[migratetype].next,
 					struct page, lru);
-			area->nr_free--;
+			area_del_free(zone, area);
 
 			/*
 			 * 如果打破一个大的页面块，将所有空闲的
@@ -1006,118 +2139,637 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 				migratetype = start_migratetype;
 			}
 
-			/* 从自由列表中删除该页 */
-			list_del(&page->lru);
-			rmv_page_order(page);
+			/* 从自由列表中删除该页 */
+			list_del(&page->lru);
+			rmv_page_order(page);
+
+			/* 对 >= pageblock_order 的订单拥有所有权 */
+			if (current_order >= pageblock_order)
+				change_pageblock_range(page, current_order,
+							start_migratetype);
+
+			expand(zone, page, order, current_order, area, migratetype);
+
+			trace_mm_page_alloc_extfrag(page, order, current_order,
+				start_migratetype, migratetype);
+
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * 从好友分配器中删除一个元素。
+ * 调用我已经持有的zone->lock。
+ */
+static struct page *__rmqueue(struct zone *zone, unsigned int order,
+						int migratetype)
+{
+	struct page *page;
+
+retry_reserve:
+	page = __rmqueue_smallest(zone, order, migratetype);
+
+	if (unlikely(!page) && migratetype != MIGRATE_RESERVE) {
+		page = __rmqueue_fallback(zone, order, migratetype);
+
+		/*
+		 * 使用MIGRATE_RESERVE，而不是分配失败。 goto
+		 * 因为 __rmqueue_smallest 是一个内联函数。
+		 * 而我们只想调用一个站点
+		 */
+		if (!page) {
+			migratetype = MIGRATE_RESERVE;
+			goto retry_reserve;
+		}
+	}
+
+	trace_mm_page_alloc_zone_locked(page, order, migratetype);
+	return page;
+}
+
+/* 
+ * 从好友分配器中获取指定数量的元素，所有这些元素都在一个锁的控制下。
+ * 为了提高效率，只需要一个锁。 将它们添加到提供的列表中。
+ * 返回放置在*列表中的新页面的数量。
+ */
+static int rmqueue_bulk(struct zone *zone, unsigned int order, 
+			unsigned long count, struct list_head *list,
+			int migratetype, int cold)
+{
+	int i;
+	
+	spin_lock(&zone->lock);
+	for (i = 0; i < count; ++i) {
+		struct page *page = __rmqueue(zone, order, migratetype);
+		if (unlikely(page == NULL))
+			break;
+
+		/*
+		 * 由expand()返回的分裂伙伴页面在这里被接收。
+		 * 按物理页面顺序。该页被添加到调用者和
+		 * 列表，然后列表头向前移动。从调用者
+		 * 的角度来看，链接列表在某些情况下是按页数排序的。
+		 * 某些情况下。这对IO设备来说是很有用的，因为如果物理页被排序，这些设备可以
+		 * 的物理页被正确排序的话，可以合并IO请求。
+		 */
+		if (likely(cold == 0))
+			list_add(&page->lru, list);
+		else
+			list_add_tail(&page->lru, list);
+		set_page_private(page, migratetype);
+		list = &page->lru;
+	}
+	__mod_zone_page_state(zone, NR_FREE_PAGES, -(i << order));
+	spin_unlock(&zone->lock);
+	return i;
+}
+
+#ifdef CONFIG_NUMA
+/*
+ * 从vmstat计数器更新器中调用，以耗尽该节点的页组。
+ * 当前在远程节点上执行的处理器的页面集在它们过期后被调用。
+ * 过期。
+ *
+ * 请注意，这个函数必须在线程被钉住的情况下调用。
+ * 单个处理器。
+ */
+void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp)
+{
+	unsigned long flags;
+	int to_drain;
+
+	local_irq_save(flags);
+	if (pcp->count >= pcp->batch)
+		to_drain = pcp->batch;
+	else
+		to_drain = pcp->count;
+	free_pcppages_bulk(zone, to_drain, pcp);
+	pcp->count -= to_drain;
+	local_irq_restore(flags);
+}
+#endif
+
+/*
+ * 1到PAGE_ALLOC_COSTLY_ORDER阶的每CPU缓存。0阶页面走per_cpu_pages，
+ * 其余的每次分配和释放都要拿zone->lock，而1阶的内核栈、2到3阶的skb
+ * 缓冲区恰恰是最常见的高阶请求。high_order_pcp=1时，这些阶的块先放在
+ * 本CPU按阶和迁移类型分开的链表里：链表空了一次从伙伴系统取
+ * high_order_pcp_batch块，超过high_order_pcp_high块时把
+ * high_order_pcp_batch块还回去，每次只拿一次zone->lock。
+ * 和0阶的PCP一样，缓存中的页面不计入NR_FREE_PAGES，由drain_pages()清空。
+ */
+#define HPCP_ORDERS	PAGE_ALLOC_COSTLY_ORDER
+
+struct high_order_pcp {
+	int count[HPCP_ORDERS];
+	struct list_head lists[HPCP_ORDERS][MIGRATE_PCPTYPES];
+};
+
+static u32 high_order_pcp __read_mostly;
+static u32 high_order_pcp_batch __read_mostly = 4;
+static u32 high_order_pcp_high __read_mostly = 16;
+
+static int __init setup_high_order_pcp(char *str)
+{
+	high_order_pcp = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("high_order_pcp=", setup_high_order_pcp);
+
+static void setup_zone_high_order_pcp(struct zone *zone)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	int cpu, i, t;
+
+	if (ext->hpcp)
+		return;
+	ext->hpcp = alloc_percpu(struct high_order_pcp);
+	if (!ext->hpcp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct high_order_pcp *hp = per_cpu_ptr(ext->hpcp, cpu);
+
+		for (i = 0; i < HPCP_ORDERS; i++) {
+			hp->count[i] = 0;
+			for (t = 0; t < MIGRATE_PCPTYPES; t++)
+				INIT_LIST_HEAD(&hp->lists[i][t]);
+		}
+	}
+}
+
+static inline bool use_high_order_pcp(struct zone *zone, unsigned int order)
+{
+	return high_order_pcp && order && order <= HPCP_ORDERS &&
+		zone_ext(zone)->hpcp;
+}
+
+/* 把本阶最多count块还给伙伴系统，调用者关中断 */
+static void hpcp_free_bulk(struct zone *zone, struct high_order_pcp *hp,
+			   unsigned int order, int count)
+{
+	int idx = order - 1;
+
+	spin_lock(&zone->lock);
+	zone->all_unreclaimable = 0;
+	zone->pages_scanned = 0;
+
+	while (count > 0 && hp->count[idx] > 0) {
+		int t;
+
+		for (t = 0; t < MIGRATE_PCPTYPES && count > 0; t++) {
+			struct list_head *list = &hp->lists[idx][t];
+			struct page *page;
+
+			if (list_empty(list))
+				continue;
+			/* 从尾部取最冷的块 */
+			page = list_entry(list->prev, struct page, lru);
+			list_del(&page->lru);
+			__free_one_page(page, zone, order,
+					get_pageblock_migratetype(page));
+			__mod_zone_page_state(zone, NR_FREE_PAGES, 1 << order);
+			hp->count[idx]--;
+			count--;
+		}
+	}
+	spin_unlock(&zone->lock);
+	async_alloc_kick();
+}
+
+/* 调用者关中断；放进本CPU的缓存时返回true */
+static bool free_high_order_pcp(struct page *page, unsigned int order)
+{
+	struct zone *zone = page_zone(page);
+	struct high_order_pcp *hp;
+	int migratetype;
+
+	if (!use_high_order_pcp(zone, order))
+		return false;
+	migratetype = get_pageblock_migratetype(page);
+	if (migratetype >= MIGRATE_PCPTYPES)
+		return false;
+
+	hp = this_cpu_ptr(zone_ext(zone)->hpcp);
+	list_add(&page->lru, &hp->lists[order - 1][migratetype]);
+	if (++hp->count[order - 1] > high_order_pcp_high)
+		hpcp_free_bulk(zone, hp, order,
+			       max_t(u32, high_order_pcp_batch, 1));
+	return true;
+}
+
+/* 调用者关中断 */
+static struct page *rmqueue_high_order_pcp(struct zone *zone,
+				unsigned int order, int migratetype)
+{
+	struct high_order_pcp *hp = this_cpu_ptr(zone_ext(zone)->hpcp);
+	struct list_head *list = &hp->lists[order - 1][migratetype];
+	struct page *page;
+
+	if (list_empty(list)) {
+		int i, got = 0;
+
+		spin_lock(&zone->lock);
+		for (i = 0; i < max_t(u32, high_order_pcp_batch, 1); i++) {
+			page = __rmqueue(zone, order, migratetype);
+			if (unlikely(!page))
+				break;
+			list_add_tail(&page->lru, list);
+			got++;
+		}
+		__mod_zone_page_state(zone, NR_FREE_PAGES, -(got << order));
+		spin_unlock(&zone->lock);
+		hp->count[order - 1] += got;
+		if (!got)
+			return NULL;
+	}
+
+	page = list_entry(list->next, struct page, lru);
+	list_del(&page->lru);
+	hp->count[order - 1]--;
+	return page;
+}
+
+/* 本CPU的缓存里有没有order阶或更高阶（不超过HPCP_ORDERS）的块 */
+static bool hpcp_has_order(struct zone *zone, unsigned int order)
+{
+	struct high_order_pcp *hp;
+	bool ret = false;
+	int i;
+
+	if (!high_order_pcp || !zone_ext(zone)->hpcp || order > HPCP_ORDERS)
+		return false;
+
+	hp = get_cpu_ptr(zone_ext(zone)->hpcp);
+	for (i = order - 1; i < HPCP_ORDERS; i++)
+		if (hp->count[i])
+			ret = true;
+	put_cpu_ptr(zone_ext(zone)->hpcp);
+	return ret;
+}
+
+static void drain_high_order_pcp(struct zone *zone, int cpu)
+{
+	struct high_order_pcp *hp;
+	int i;
+
+	if (!zone_ext(zone)->hpcp)
+		return;
+	hp = per_cpu_ptr(zone_ext(zone)->hpcp, cpu);
+	for (i = 0; i < HPCP_ORDERS; i++)
+		if (hp->count[i])
+			hpcp_free_bulk(zone, hp, i + 1, hp->count[i]);
+}
+
+static bool has_high_order_pcp(struct zone *zone, int cpu)
+{
+	struct high_order_pcp *hp;
+	int i;
+
+	if (!zone_ext(zone)->hpcp)
+		return false;
+	hp = per_cpu_ptr(zone_ext(zone)->hpcp, cpu);
+	for (i = 0; i < HPCP_ORDERS; i++)
+		if (hp->count[i])
+			return true;
+	return false;
+}
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * page_alloc/high_order_bench：写入"阶 次数"后，在每个在线CPU上各起一个
+ * 绑定的内核线程，同时开始做这么多次alloc_pages()/__free_pages()配对，
+ * 读出最近一次每对的平均纳秒数和分配失败的次数。high_order_pcp的开关
+ * 决定配对走每CPU缓存还是zone->lock，helloylt highorder比较两者。
+ */
+struct hpcp_bench {
+	unsigned int order;
+	unsigned long loops;
+	struct completion start;
+	int nr_threads;
+	atomic64_t ns;
+	atomic_long_t failed;
+	atomic_t running;
+	struct completion done;
+};
+
+static DEFINE_MUTEX(hpcp_bench_mutex);
+static unsigned int hpcp_bench_order;
+static unsigned long hpcp_bench_loops, hpcp_bench_failed;
+static int hpcp_bench_threads;
+static u64 hpcp_bench_ns;
+
+static int hpcp_bench_thread(void *arg)
+{
+	struct hpcp_bench *b = arg;
+	unsigned long i, failed = 0;
+	u64 start;
+
+	/* 所有线程都创建好以后一起开始，测的是并发时的开销 */
+	wait_for_completion(&b->start);
+
+	start = local_clock();
+	for (i = 0; i < b->loops; i++) {
+		struct page *page = alloc_pages(GFP_KERNEL | __GFP_NOWARN,
+						b->order);
+
+		if (page)
+			__free_pages(page, b->order);
+		else
+			failed++;
+	}
+	atomic64_add(local_clock() - start, &b->ns);
+	atomic_long_add(failed, &b->failed);
+
+	if (atomic_dec_and_test(&b->running))
+		complete(&b->done);
+	return 0;
+}
+
+static int hpcp_bench_show(struct seq_file *m, void *arg)
+{
+	mutex_lock(&hpcp_bench_mutex);
+	seq_printf(m, "order %u\nloops %lu\nthreads %d\nns_per_pair %llu\n"
+		   "failed %lu\n", hpcp_bench_order, hpcp_bench_loops,
+		   hpcp_bench_threads, (unsigned long long)hpcp_bench_ns,
+		   hpcp_bench_failed);
+	mutex_unlock(&hpcp_bench_mutex);
+	return 0;
+}
+
+static int hpcp_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hpcp_bench_show, NULL);
+}
+
+static ssize_t hpcp_bench_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct hpcp_bench b;
+	unsigned int order;
+	unsigned long loops;
+	char buf[32];
+	int cpu;
 
-			/* 对 >= pageblock_order 的订单拥有所有权 */
-			if (current_order >= pageblock_order)
-				change_pageblock_range(page, current_order,
-							start_migratetype);
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%u %lu", &order, &loops) != 2 ||
+	    order >= MAX_ORDER || !loops)
+		return -EINVAL;
 
-			expand(zone, page, order, current_order, area, migratetype);
+	mutex_lock(&hpcp_bench_mutex);
+	get_online_cpus();
+	b.order = order;
+	b.loops = loops;
+	b.nr_threads = num_online_cpus();
+	init_completion(&b.start);
+	atomic_set(&b.running, b.nr_threads);
+	atomic64_set(&b.ns, 0);
+	atomic_long_set(&b.failed, 0);
+	init_completion(&b.done);
 
-			trace_mm_page_alloc_extfrag(page, order, current_order,
-				start_migratetype, migratetype);
+	for_each_online_cpu(cpu) {
+		struct task_struct *t;
 
-			return page;
+		t = kthread_create(hpcp_bench_thread, &b, "hpcp_bench/%d", cpu);
+		if (IS_ERR(t)) {
+			b.nr_threads--;
+			if (atomic_dec_and_test(&b.running))
+				complete(&b.done);
+			continue;
 		}
+		kthread_bind(t, cpu);
+		wake_up_process(t);
 	}
-
-	return NULL;
-}
+	complete_all(&b.start);
+	wait_for_completion(&b.done);
+	put_online_cpus();
+
+	hpcp_bench_order = order;
+	hpcp_bench_loops = loops;
+	hpcp_bench_threads = b.nr_threads;
+	hpcp_bench_failed = atomic_long_read(&b.failed);
+	hpcp_bench_ns = b.nr_threads ? div64_u64(atomic64_read(&b.ns),
+				(u64)b.nr_threads * loops) : 0;
+	mutex_unlock(&hpcp_bench_mutex);
+
+	return count;
+}
+
+static const struct file_operations hpcp_bench_fops = {
+	.open		= hpcp_bench_open,
+	.read		= seq_read,
+	.write		= hpcp_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
 
 /*
- * 从好友分配器中删除一个元素。
- * 调用我已经持有的zone->lock。
+ * 页着色模式。虚拟索引的缓存（例如MIPS）上，物理页号的低几位决定页面
+ * 落在哪个缓存颜色里。zone_batchsize()靠挑选批量大小间接避开别名，这里
+ * 则显式地按颜色分发0阶页面。page_colours=N（2的幂，不超过
+ * PAGE_COLOURS_MAX，0或1表示关闭）在启动时打开它。
+ *
+ * 打开后0阶页面不再进入per_cpu_pages的链表，而是放在zone_alloc_ext中
+ * 按迁移类型和颜色分开的每CPU链表里：释放时按pfn的颜色挂入；分配时取
+ * 指定的颜色，没有指定时每个CPU轮流要下一种颜色，不论上一次是否命中。
+ * 想要的颜色空了，就从伙伴系统取一批页面按颜色分发；仍然没有时取下一种
+ * 非空的颜色，算作一次未命中。批量大小和上限沿用该区per_cpu_pages的
+ * batch和high，drain_pages()一并清空。alloc_page_colour()可以要求
+ * 特定的颜色，见page_alloc_ext.h。
  */
-static struct page *__rmqueue(struct zone *zone, unsigned int order,
-						int migratetype)
+#define PAGE_COLOURS_MAX	16
+
+struct colour_pcp {
+	int count;
+	struct list_head lists[MIGRATE_PCPTYPES][PAGE_COLOURS_MAX];
+};
+
+static unsigned int page_colour_mask __read_mostly;
+
+static int __init setup_page_colours(char *str)
 {
-	struct page *page;
+	unsigned long colours = simple_strtoul(str, &str, 0);
 
-retry_reserve:
-	page = __rmqueue_smallest(zone, order, migratetype);
+	if (colours > 1 && colours <= PAGE_COLOURS_MAX &&
+	    is_power_of_2(colours))
+		page_colour_mask = colours - 1;
+	else if (colours > 1)
+		printk(KERN_WARNING "page_colours=%lu must be a power of 2 "
+				    "up to %d, colouring disabled\n",
+		       colours, PAGE_COLOURS_MAX);
+	return 1;
+}
+__setup("page_colours=", setup_page_colours);
 
-	if (unlikely(!page) && migratetype != MIGRATE_RESERVE) {
-		page = __rmqueue_fallback(zone, order, migratetype);
+struct page_colour_state {
+	unsigned int next;
+	unsigned long hit;
+	unsigned long miss;
+};
+static DEFINE_PER_CPU(struct page_colour_state, page_colour_state);
 
-		/*
-		 * 使用MIGRATE_RESERVE，而不是分配失败。 goto
-		 * 因为 __rmqueue_smallest 是一个内联函数。
-		 * 而我们只想调用一个站点
-		 */
-		if (!page) {
-			migratetype = MIGRATE_RESERVE;
-			goto retry_reserve;
-		}
+static void setup_zone_colour_pcp(struct zone *zone)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	int cpu, t, c;
+
+	if (!page_colour_mask || ext->cpcp)
+		return;
+	ext->cpcp = alloc_percpu(struct colour_pcp);
+	if (!ext->cpcp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct colour_pcp *cp = per_cpu_ptr(ext->cpcp, cpu);
+
+		cp->count = 0;
+		for (t = 0; t < MIGRATE_PCPTYPES; t++)
+			for (c = 0; c < PAGE_COLOURS_MAX; c++)
+				INIT_LIST_HEAD(&cp->lists[t][c]);
 	}
+}
 
-	trace_mm_page_alloc_zone_locked(page, order, migratetype);
-	return page;
+static inline bool use_colour_pcp(struct zone *zone)
+{
+	return page_colour_mask && zone_ext(zone)->cpcp;
 }
 
-/* 
- * 从好友分配器中获取指定数量的元素，所有这些元素都在一个锁的控制下。
- * 为了提高效率，只需要一个锁。 将它们添加到提供的列表中。
- * 返回放置在*列表中的新页面的数量。
+static inline unsigned int page_colour(struct page *page)
+{
+	return page_to_pfn(page) & page_colour_mask;
+}
+
+/*
+ * 把最多count个页面还给伙伴系统，在迁移类型和颜色之间轮流取最冷的
+ * 页面。调用者关中断
  */
-static int rmqueue_bulk(struct zone *zone, unsigned int order, 
-			unsigned long count, struct list_head *list,
-			int migratetype, int cold)
+static void colour_pcp_free_bulk(struct zone *zone, struct colour_pcp *cp,
+				 int count)
 {
-	int i;
-	
+	int t, c, freed = 0;
+	bool progress = true;
+
 	spin_lock(&zone->lock);
-	for (i = 0; i < count; ++i) {
-		struct page *page = __rmqueue(zone, order, migratetype);
-		if (unlikely(page == NULL))
-			break;
+	zone->all_unreclaimable = 0;
+	zone->pages_scanned = 0;
 
-		/*
-		 * 由expand()返回的分裂伙伴页面在这里被接收。
-		 * 按物理页面顺序。该页被添加到调用者和
-		 * 列表，然后列表头向前移动。从调用者
-		 * 的角度来看，链接列表在某些情况下是按页数排序的。
-		 * 某些情况下。这对IO设备来说是很有用的，因为如果物理页被排序，这些设备可以
-		 * 的物理页被正确排序的话，可以合并IO请求。
-		 */
-		if (likely(cold == 0))
-			list_add(&page->lru, list);
-		else
-			list_add_tail(&page->lru, list);
-		set_page_private(page, migratetype);
-		list = &page->lru;
+	while (freed < count && progress) {
+		progress = false;
+		for (t = 0; t < MIGRATE_PCPTYPES; t++) {
+			for (c = 0; c <= page_colour_mask && freed < count; c++) {
+				struct list_head *list = &cp->lists[t][c];
+				struct page *page;
+
+				if (list_empty(list))
+					continue;
+				page = list_entry(list->prev, struct page, lru);
+				list_del(&page->lru);
+				__free_one_page(page, zone, 0, page_private(page));
+				trace_mm_page_pcpu_drain(page, 0,
+							 page_private(page));
+				freed++;
+				progress = true;
+			}
+		}
 	}
-	__mod_zone_page_state(zone, NR_FREE_PAGES, -(i << order));
+	cp->count -= freed;
+	__mod_zone_page_state(zone, NR_FREE_PAGES, freed);
 	spin_unlock(&zone->lock);
-	return i;
+	async_alloc_kick();
 }
 
-#ifdef CONFIG_NUMA
 /*
- * 从vmstat计数器更新器中调用，以耗尽该节点的页组。
- * 当前在远程节点上执行的处理器的页面集在它们过期后被调用。
- * 过期。
- *
- * 请注意，这个函数必须在线程被钉住的情况下调用。
- * 单个处理器。
+ * 调用者关中断，page_private中已经是迁移类型。放进着色链表时返回true，
+ * 超过pcp->high时还回pcp->batch个页面。
  */
-void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp)
+static bool free_colour_pcp(struct zone *zone, struct per_cpu_pages *pcp,
+			    struct page *page, int migratetype, int cold)
 {
-	unsigned long flags;
-	int to_drain;
+	struct colour_pcp *cp;
+	struct list_head *list;
 
-	local_irq_save(flags);
-	if (pcp->count >= pcp->batch)
-		to_drain = pcp->batch;
+	if (!use_colour_pcp(zone))
+		return false;
+
+	cp = this_cpu_ptr(zone_ext(zone)->cpcp);
+	list = &cp->lists[migratetype][page_colour(page)];
+	if (cold)
+		list_add_tail(&page->lru, list);
 	else
-		to_drain = pcp->count;
-	free_pcppages_bulk(zone, to_drain, pcp);
-	pcp->count -= to_drain;
-	local_irq_restore(flags);
+		list_add(&page->lru, list);
+	if (++cp->count >= pcp->high)
+		colour_pcp_free_bulk(zone, cp, max(pcp->batch, 1));
+	return true;
+}
+
+/* 调用者关中断。colour为负时按本CPU的轮转顺序取下一种颜色 */
+static struct page *rmqueue_colour_pcp(struct zone *zone,
+			struct per_cpu_pages *pcp, int migratetype,
+			int cold, int colour)
+{
+	struct page_colour_state *state = &__get_cpu_var(page_colour_state);
+	struct colour_pcp *cp = this_cpu_ptr(zone_ext(zone)->cpcp);
+	struct list_head *lists = cp->lists[migratetype];
+	struct page *page, *next;
+	unsigned int want, i;
+
+	if (colour < 0) {
+		want = state->next & page_colour_mask;
+		state->next = want + 1;
+	} else
+		want = colour & page_colour_mask;
+
+	if (list_empty(&lists[want])) {
+		LIST_HEAD(batch);
+
+		cp->count += rmqueue_bulk(zone, 0, max(pcp->batch, 1), &batch,
+					  migratetype, cold);
+		list_for_each_entry_safe(page, next, &batch, lru)
+			list_move_tail(&page->lru, &lists[page_colour(page)]);
+	}
+
+	for (i = 0; i <= page_colour_mask; i++) {
+		struct list_head *list = &lists[(want + i) & page_colour_mask];
+
+		if (list_empty(list))
+			continue;
+		if (i)
+			state->miss++;
+		else
+			state->hit++;
+		page = list_entry(cold ? list->prev : list->next,
+				  struct page, lru);
+		list_del(&page->lru);
+		cp->count--;
+		return page;
+	}
+	return NULL;
+}
+
+static void drain_colour_pcp(struct zone *zone, int cpu)
+{
+	struct colour_pcp *cp;
+
+	if (!zone_ext(zone)->cpcp)
+		return;
+	cp = per_cpu_ptr(zone_ext(zone)->cpcp, cpu);
+	if (cp->count)
+		colour_pcp_free_bulk(zone, cp, cp->count);
+}
+
+static bool has_colour_pcp(struct zone *zone, int cpu)
+{
+	return zone_ext(zone)->cpcp &&
+		per_cpu_ptr(zone_ext(zone)->cpcp, cpu)->count;
 }
-#endif
 
 /*
  * 排空指定处理器的页面。
@@ -1143,6 +2795,8 @@ static void drain_pages(unsigned int cpu)
 			free_pcppages_bulk(zone, pcp->count, pcp);
 			pcp->count = 0;
 		}
+		drain_high_order_pcp(zone, cpu);
+		drain_colour_pcp(zone, cpu);
 		local_irq_restore(flags);
 	}
 }
@@ -1182,11 +2836,16 @@ void drain_all_pages(void)
 	 * cpu耗尽该CPU的pcps和on_each_cpu_mask
 	 * 作为其处理的一部分，禁用了抢占。
 	 */
+	/* 延迟释放队列在这里清空，不要放到IPI里关着中断做 */
+	for_each_online_cpu(cpu)
+		deferred_free_flush_cpu(cpu);
+
 	for_each_online_cpu(cpu) {
 		bool has_pcps = false;
 		for_each_populated_zone(zone) {
 			pcp = per_cpu_ptr(zone->pageset, cpu);
-			if (pcp->pcp.count) {
+			if (pcp->pcp.count || has_high_order_pcp(zone, cpu) ||
+			    has_colour_pcp(zone, cpu)) {
 				has_pcps = true;
 				break;
 			}
@@ -1201,40 +2860,171 @@ void drain_all_pages(void)
 
 #ifdef CONFIG_HIBERNATION
 
+/*
+ * 每处理这么多页就喂一次NMI看门狗。大内存机器上这两遍扫描可能长达
+ * 数秒，而调用时中断是关闭的。
+ */
+#define WD_PAGE_COUNT	(128 * 1024)
+
 void mark_free_pages(struct zone *zone)
 {
-	unsigned long pfn, max_zone_pfn;
-	unsigned long flags;
+	unsigned long pfn, max_zone_pfn, page_count = WD_PAGE_COUNT;
+	unsigned long flags, nr_free = 0;
 	int order, t;
 	struct list_head *curr;
+	u64 start;
 
 	if (!zone->spanned_pages)
 		return;
 
-	spin_lock_irqsave(&zone->lock, flags);
+	start = local_clock();
 
+	/*
+	 * 清除PageNosaveFree只改动快照自己的位图，不读伙伴状态，
+	 * 不需要持有zone->lock。空洞以MAX_ORDER块为单位整块跳过。
+	 */
 	max_zone_pfn = zone->zone_start_pfn + zone->spanned_pages;
-	for (pfn = zone->zone_start_pfn; pfn < max_zone_pfn; pfn++)
-		if (pfn_valid(pfn)) {
-			struct page *page = pfn_to_page(pfn);
+	for (pfn = zone->zone_start_pfn; pfn < max_zone_pfn; pfn++) {
+		struct page *page;
 
-			if (!swsusp_page_is_forbidden(page))
-				swsusp_unset_page_free(page);
+		if (!pfn_valid(pfn)) {
+			pfn = ALIGN(pfn + 1, MAX_ORDER_NR_PAGES) - 1;
+			continue;
+		}
+		if (!--page_count) {
+			touch_nmi_watchdog();
+			page_count = WD_PAGE_COUNT;
 		}
 
+		page = pfn_to_page(pfn);
+		if (!swsusp_page_is_forbidden(page))
+			swsusp_unset_page_free(page);
+	}
+
+	spin_lock_irqsave(&zone->lock, flags);
 	for_each_migratetype_order(order, t) {
 		list_for_each(curr, &zone->free_area[order].free_list[t]) {
 			unsigned long i;
 
 			pfn = page_to_pfn(list_entry(curr, struct page, lru));
-			for (i = 0; i < (1UL << order); i++)
+			for (i = 0; i < (1UL << order); i++) {
+				if (!--page_count) {
+					touch_nmi_watchdog();
+					page_count = WD_PAGE_COUNT;
+				}
 				swsusp_set_page_free(pfn_to_page(pfn + i));
+			}
+			nr_free += 1UL << order;
 		}
 	}
 	spin_unlock_irqrestore(&zone->lock, flags);
+
+	printk(KERN_DEBUG "PM: marked %lu free pages in zone %s in %llu us\n",
+	       nr_free, zone->name, div_u64(local_clock() - start, NSEC_PER_USEC));
 }
 #endif /* CONFIG_PM */
 
+/*
+ * pcp的batch和high的运行时调整。原来zone_pcp_update()用stop_machine()
+ * 替所有CPU清空并重置pageset，percpu_pagelist_fraction的sysctl则直接
+ * 改写别的CPU正在使用的pcp->high。现在调整者只把新值连同递增的代号
+ * 发布到区的旁路状态中，每个CPU在下一次补充或释放到pcp时发现代号
+ * 变了，才在关中断的情况下改自己的pcp；谁也不用停下来等别人。
+ * 新high比当前count小时，多出来的页面由随后的释放分批还回去。
+ */
+static DEFINE_MUTEX(pcp_config_mutex);
+
+static void setup_zone_pcp_config(struct zone *zone)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+
+	if (!ext->pcp_seen)
+		ext->pcp_seen = alloc_percpu(unsigned int);
+}
+
+static void pcp_config_publish(struct zone *zone, unsigned long high,
+			       unsigned long batch)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	unsigned long flags;
+
+	mutex_lock(&pcp_config_mutex);
+	/* 关中断，免得本CPU上的中断在读端等待写端结束 */
+	local_irq_save(flags);
+	write_seqcount_begin(&ext->pcp_seq);
+	ext->pcp_high = high;
+	ext->pcp_batch = batch;
+	ext->pcp_gen++;
+	write_seqcount_end(&ext->pcp_seq);
+	local_irq_restore(flags);
+	mutex_unlock(&pcp_config_mutex);
+}
+
+static noinline void __pcp_config_apply(struct zone_alloc_ext *ext,
+					struct per_cpu_pages *pcp)
+{
+	unsigned int seq, gen;
+	unsigned long high, batch;
+
+	do {
+		seq = read_seqcount_begin(&ext->pcp_seq);
+		gen = ext->pcp_gen;
+		high = ext->pcp_high;
+		batch = ext->pcp_batch;
+	} while (read_seqcount_retry(&ext->pcp_seq, seq));
+
+	pcp->high = high;
+	pcp->batch = batch;
+	*this_cpu_ptr(ext->pcp_seen) = gen;
+}
+
+/* 调用者关中断 */
+static inline void pcp_config_apply(struct zone *zone,
+				    struct per_cpu_pages *pcp)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+
+	if (unlikely(ext->pcp_seen &&
+		     *this_cpu_ptr(ext->pcp_seen) != ACCESS_ONCE(ext->pcp_gen)))
+		__pcp_config_apply(ext, pcp);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int pcp_config_show(struct seq_file *m, void *arg)
+{
+	struct zone *zone;
+
+	seq_printf(m, "node zone     gen      batch    high     lagging_cpus\n");
+	for_each_populated_zone(zone) {
+		struct zone_alloc_ext *ext = zone_ext(zone);
+		unsigned int gen = ACCESS_ONCE(ext->pcp_gen);
+		int cpu, lagging = 0;
+
+		if (!ext->pcp_seen)
+			continue;
+		for_each_online_cpu(cpu)
+			if (*per_cpu_ptr(ext->pcp_seen, cpu) != gen)
+				lagging++;
+		seq_printf(m, "%-4d %-8s %-8u %-8lu %-8lu %d\n",
+			   zone_to_nid(zone), zone->name, gen,
+			   ext->pcp_batch, ext->pcp_high, lagging);
+	}
+	return 0;
+}
+
+static int pcp_config_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pcp_config_show, NULL);
+}
+
+static const struct file_operations pcp_config_fops = {
+	.open		= pcp_config_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  * 释放一个0阶的页面
  * cold == 1 ? 释放一个冷页 : 释放一个热页
@@ -1260,19 +3050,18 @@ void free_hot_cold_page(struct page *page, int cold)
 	/*
 	 * 我们只跟踪pcp列表中的不可移动、可回收和可移动的页面。
 	 * 释放ISOLATE页到分配器中，因为它们正在被删除。
-	 * 但把RESERVE当作可移动的页面，这样我们就可以在必要时把这些
-	 * 如果有必要，我们可以把这些区域拿回来。否则，我们可能不得不释放
-	 * 过多地进入页面分配器
+	 * RESERVE页也直接还给伙伴系统，而不是混进可移动的pcp列表里
+	 * 被别的分配拿走：保留块要尽快重新合并成高阶块，留给高阶原子分配。
 	 */
 	if (migratetype >= MIGRATE_PCPTYPES) {
-		if (unlikely(migratetype == MIGRATE_ISOLATE)) {
-			free_one_page(zone, page, 0, migratetype);
-			goto out;
-		}
-		migratetype = MIGRATE_MOVABLE;
+		free_one_page(zone, page, 0, migratetype);
+		goto out;
 	}
 
 	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	pcp_config_apply(zone, pcp);
+	if (free_colour_pcp(zone, pcp, page, migratetype, cold))
+		goto out;
 	if (cold)
 		list_add_tail(&page->lru, &pcp->lists[migratetype]);
 	else
@@ -1326,6 +3115,7 @@ void split_page(struct page *page, unsigned int order)
 
 	for (i = 1; i < (1 << order); i++)
 		set_page_refcounted(page + i);
+	split_page_owner(page, order);
 }
 
 /*
@@ -1356,7 +3146,7 @@ int split_free_page(struct page *page)
 
 	/* 从自由列表中删除页面 */
 	list_del(&page->lru);
-	zone->free_area[order].nr_free--;
+	area_del_free(zone, &zone->free_area[order]);
 	rmv_page_order(page);
 	__mod_zone_page_state(zone, NR_FREE_PAGES, -(1UL << order));
 
@@ -1373,6 +3163,34 @@ int split_free_page(struct page *page)
 	return 1 << order;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int page_colour_show(struct seq_file *m, void *arg)
+{
+	unsigned long hit = 0, miss = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		hit += per_cpu(page_colour_state, cpu).hit;
+		miss += per_cpu(page_colour_state, cpu).miss;
+	}
+	seq_printf(m, "colours %u\nhit     %lu\nmiss    %lu\n",
+		   page_colour_mask + 1, hit, miss);
+	return 0;
+}
+
+static int page_colour_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, page_colour_show, NULL);
+}
+
+static const struct file_operations page_colour_fops = {
+	.open		= page_colour_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  * 实际上，prep_compound_page()应该由__rmqueue_bulk()调用。 但是
  * 我们通过从这里调用它来作弊，在顺序>0的路径中。 省去了一个分支
@@ -1381,7 +3199,7 @@ int split_free_page(struct page *page)
 static inline
 struct page *buffered_rmqueue(struct zone *preferred_zone,
 			struct zone *zone, int order, gfp_t gfp_flags,
-			int migratetype)
+			int migratetype, int colour)
 {
 	unsigned long flags;
 	struct page *page;
@@ -1394,8 +3212,17 @@ again:
 
 		local_irq_save(flags);
 		pcp = &this_cpu_ptr(zone->pageset)->pcp;
+		if (use_colour_pcp(zone)) {
+			pcp_config_apply(zone, pcp);
+			page = rmqueue_colour_pcp(zone, pcp, migratetype,
+						  cold, colour);
+			if (unlikely(!page))
+				goto failed;
+			goto got_page;
+		}
 		list = &pcp->lists[migratetype];
 		if (list_empty(list)) {
+			pcp_config_apply(zone, pcp);
 			pcp->count += rmqueue_bulk(zone, 0,
 					pcp->batch, list,
 					migratetype, cold);
@@ -1424,14 +3251,24 @@ again:
 			 */
 			WARN_ON_ONCE(order > 1);
 		}
-		spin_lock_irqsave(&zone->lock, flags);
-		page = __rmqueue(zone, order, migratetype);
-		spin_unlock(&zone->lock);
-		if (!page)
-			goto failed;
-		__mod_zone_page_state(zone, NR_FREE_PAGES, -(1 << order));
+		if (use_high_order_pcp(zone, order) &&
+		    migratetype < MIGRATE_PCPTYPES) {
+			local_irq_save(flags);
+			page = rmqueue_high_order_pcp(zone, order, migratetype);
+			if (!page)
+				goto failed;
+		} else {
+			spin_lock_irqsave(&zone->lock, flags);
+			page = __rmqueue(zone, order, migratetype);
+			spin_unlock(&zone->lock);
+			if (!page)
+				goto failed;
+			__mod_zone_page_state(zone, NR_FREE_PAGES,
+					      -(1 << order));
+		}
 	}
 
+got_page:
 	__count_zone_vm_events(PGALLOC, zone, 1 << order);
 	zone_statistics(preferred_zone, zone, gfp_flags);
 	local_irq_restore(flags);
@@ -1452,12 +3289,81 @@ failed:
 #define ALLOC_WMARK_HIGH	WMARK_HIGH
 #define ALLOC_NO_WATERMARKS	0x04 /*完全不检查水印 */
 
-/* 获得水印位的掩码 */
-#define ALLOC_WMARK_MASK	(ALLOC_NO_WATERMARKS-1)
+/* 获得水印位的掩码 */
+#define ALLOC_WMARK_MASK	(ALLOC_NO_WATERMARKS-1)
+
+#define ALLOC_HARDER		0x10 /* 尝试更努力地分配 */
+#define ALLOC_HIGH		0x20 /* __GFP_HIGH设置 */
+#define ALLOC_CPUSET		0x40 /* 检查正确的cpuset */
+#define ALLOC_COLOUR		0x80 /* 0阶页面要求更高位中的颜色 */
+#define ALLOC_COLOUR_SHIFT	8
+
+static inline int alloc_flags_colour(int alloc_flags)
+{
+	return alloc_flags & ALLOC_COLOUR ?
+		alloc_flags >> ALLOC_COLOUR_SHIFT : -1;
+}
+
+/*
+ * 分配的真正调用点，供分配失败的汇总、快照和fail_page_alloc的调用点
+ * 过滤使用。__alloc_pages_nodemask()把自己的返回地址传下来，经
+ * alloc_pages_node()等内联函数分配时它就是调用点；但NUMA下alloc_pages()
+ * 总是经过alloc_pages_current()，__get_free_pages()等包装函数也会
+ * 挡在中间。这时沿调用栈向上，越过分配器入口以及这些包装函数所在的
+ * 栈帧，取其后第一个返回地址。按函数而不是按固定的深度跳过，不受
+ * 内联的影响；没有栈回溯或符号表时退回到传入的返回地址。
+ */
+#define ALLOC_CALLER_DEPTH	16
+
+static const unsigned long alloc_entry_funcs[] = {
+	(unsigned long)__alloc_pages_nodemask,
+	(unsigned long)__get_free_pages,
+	(unsigned long)get_zeroed_page,
+	(unsigned long)alloc_pages_exact,
+	(unsigned long)alloc_pages_exact_nid,
+#ifdef CONFIG_NUMA
+	(unsigned long)alloc_pages_current,
+	(unsigned long)alloc_pages_vma,
+#endif
+};
+
+static bool in_alloc_entry(unsigned long addr)
+{
+	unsigned long size, offset;
+	int i;
+
+	if (!kallsyms_lookup_size_offset(addr, &size, &offset))
+		return false;
+	for (i = 0; i < ARRAY_SIZE(alloc_entry_funcs); i++)
+		if (addr - offset == alloc_entry_funcs[i])
+			return true;
+	return false;
+}
+
+static unsigned long alloc_caller(unsigned long ret_ip)
+{
+#ifdef CONFIG_STACKTRACE
+	unsigned long entries[ALLOC_CALLER_DEPTH];
+	struct stack_trace trace = {
+		.max_entries	= ALLOC_CALLER_DEPTH,
+		.entries	= entries,
+	};
+	bool inside = false;
+	int i;
+
+	if (!in_alloc_entry(ret_ip))
+		return ret_ip;
 
-#define ALLOC_HARDER		0x10 /* 尝试更努力地分配 */
-#define ALLOC_HIGH		0x20 /* __GFP_HIGH设置 */
-#define ALLOC_CPUSET		0x40 /* 检查正确的cpuset */
+	save_stack_trace(&trace);
+	for (i = 0; i < trace.nr_entries && entries[i] != ULONG_MAX; i++) {
+		if (in_alloc_entry(entries[i]))
+			inside = true;
+		else if (inside)
+			return entries[i];
+	}
+#endif
+	return ret_ip;
+}
 
 #ifdef CONFIG_FAIL_PAGE_ALLOC
 
@@ -1467,11 +3373,29 @@ static struct {
 	u32 ignore_gfp_highmem;
 	u32 ignore_gfp_wait;
 	u32 min_order;
+	/*
+	 * 接下来这么多次直接回收/直接压缩按失败处理，用于检验慢速路径统计。
+	 * 0阶分配本来就不做压缩，不消耗inject_compact_fail
+	 */
+	u32 inject_reclaim_fail;
+	u32 inject_compact_fail;
+	/* 过滤条件：gfp必须包含require_gfp的全部位、不含ignore_gfp的任何位 */
+	u32 max_order;
+	u32 require_gfp;
+	u32 ignore_gfp;
+	/* 非0时只对返回地址落在[caller_start, caller_end)内的分配生效 */
+	u64 caller_start;
+	u64 caller_end;
+	/* 确定性重放模式，见pa_fail_replay_hit() */
+	u32 replay;
+	u32 replay_seed;
+	u32 replay_period;
 } fail_page_alloc = {
 	.attr = FAULT_ATTR_INITIALIZER,
 	.ignore_gfp_wait = 1,
 	.ignore_gfp_highmem = 1,
 	.min_order = 1,
+	.max_order = MAX_ORDER - 1,
 };
 
 static int __init setup_fail_page_alloc(char *str)
@@ -1480,22 +3404,239 @@ static int __init setup_fail_page_alloc(char *str)
 }
 __setup("fail_page_alloc=", setup_fail_page_alloc);
 
-static int should_fail_alloc_page(gfp_t gfp_mask, unsigned int order)
+/*
+ * 确定性重放。fault_attr按概率和间隔注入，同样的测试跑两遍失败的是
+ * 不同的分配，驱动的健壮性问题很难复现。replay=1时不再看fault_attr，
+ * 而是给每个通过过滤条件的分配编一个从0开始的序号，序号在显式调度表
+ * replay-schedule中，或者replay_period非0且hash(序号^replay_seed)落在
+ * 前1/replay_period的范围里时失败。相同的种子、调度表和分配序列得到完全相同的
+ * 失败位置；写replay-schedule会把序号和失败记录一起清零，开始新的一轮。
+ *
+ * 判定本身是page_alloc_shared.h中的pa_fail_replay_hit()，只依赖参数，
+ * 用户态的helloylt replay包含同一个头文件，按相同的种子和调度表预先
+ * 算出失败的序号。
+ */
+#define FAIL_REPLAY_SCHEDULE	64
+#define FAIL_REPLAY_LOG		64
+
+struct fail_replay_record {
+	u32 index;
+	u32 order;
+	gfp_t gfp_mask;
+	unsigned long caller;
+	u64 timestamp;
+};
+
+static u32 fail_replay_schedule[FAIL_REPLAY_SCHEDULE];
+static int fail_replay_nr;
+static atomic_t fail_replay_index = ATOMIC_INIT(0);
+static struct fail_replay_record fail_replay_log[FAIL_REPLAY_LOG];
+static unsigned int fail_replay_logged;
+static DEFINE_SPINLOCK(fail_replay_lock);
+
+static void fail_replay_log_add(u32 index, gfp_t gfp_mask, unsigned int order,
+				unsigned long caller)
+{
+	struct fail_replay_record *r;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fail_replay_lock, flags);
+	r = &fail_replay_log[fail_replay_logged++ % FAIL_REPLAY_LOG];
+	r->index = index;
+	r->order = order;
+	r->gfp_mask = gfp_mask;
+	r->caller = caller;
+	r->timestamp = local_clock();
+	spin_unlock_irqrestore(&fail_replay_lock, flags);
+}
+
+static int should_fail_alloc_page(gfp_t gfp_mask, unsigned int order,
+				  unsigned long caller)
 {
+	u32 index;
+
 	if (order < fail_page_alloc.min_order)
 		return 0;
+	if (order > fail_page_alloc.max_order)
+		return 0;
 	if (gfp_mask & __GFP_NOFAIL)
 		return 0;
 	if (fail_page_alloc.ignore_gfp_highmem && (gfp_mask & __GFP_HIGHMEM))
 		return 0;
 	if (fail_page_alloc.ignore_gfp_wait && (gfp_mask & __GFP_WAIT))
 		return 0;
+	if ((gfp_mask & fail_page_alloc.require_gfp) !=
+	    fail_page_alloc.require_gfp)
+		return 0;
+	if (gfp_mask & fail_page_alloc.ignore_gfp)
+		return 0;
+	if (fail_page_alloc.caller_end) {
+		caller = alloc_caller(caller);
+		if (caller < fail_page_alloc.caller_start ||
+		    caller >= fail_page_alloc.caller_end)
+			return 0;
+	}
+
+	if (!fail_page_alloc.replay)
+		return should_fail(&fail_page_alloc.attr, 1 << order);
+
+	index = atomic_inc_return(&fail_replay_index) - 1;
+	if (!pa_fail_replay_hit(fail_page_alloc.replay_seed,
+				fail_page_alloc.replay_period, index,
+				fail_replay_schedule,
+				ACCESS_ONCE(fail_replay_nr)))
+		return 0;
+
+	if (!fail_page_alloc.caller_end)
+		caller = alloc_caller(caller);
+	fail_replay_log_add(index, gfp_mask, order, caller);
+	return 1;
+}
+
+static bool consume_inject_count(u32 *count)
+{
+	u32 old;
+
+	do {
+		old = ACCESS_ONCE(*count);
+		if (!old)
+			return false;
+	} while (cmpxchg(count, old, old - 1) != old);
+
+	return true;
+}
+
+static inline bool should_inject_reclaim_fail(void)
+{
+	return consume_inject_count(&fail_page_alloc.inject_reclaim_fail);
+}
 
-	return should_fail(&fail_page_alloc.attr, 1 << order);
+static inline bool should_inject_compact_fail(unsigned int order)
+{
+	if (!order)
+		return false;
+	return consume_inject_count(&fail_page_alloc.inject_compact_fail);
 }
 
 #ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
 
+static int fail_replay_schedule_show(struct seq_file *m, void *arg)
+{
+	int i;
+
+	spin_lock_irq(&fail_replay_lock);
+	for (i = 0; i < fail_replay_nr; i++)
+		seq_printf(m, "%u\n", fail_replay_schedule[i]);
+	spin_unlock_irq(&fail_replay_lock);
+	return 0;
+}
+
+static int fail_replay_schedule_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fail_replay_schedule_show, NULL);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 以空白或逗号分隔的失败序号，最多FAIL_REPLAY_SCHEDULE个；空串清空调度表 */
+static ssize_t fail_replay_schedule_write(struct file *file,
+			const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	u32 schedule[FAIL_REPLAY_SCHEDULE];
+	char buf[512], *p;
+	int nr = 0;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	p = buf;
+	for (;;) {
+		char *end;
+		unsigned long val;
+
+		p = skip_spaces(p);
+		while (*p == ',')
+			p = skip_spaces(p + 1);
+		if (!*p)
+			break;
+		val = simple_strtoul(p, &end, 0);
+		if (end == p || val > (u32)~0U || nr == FAIL_REPLAY_SCHEDULE)
+			return -EINVAL;
+		schedule[nr++] = val;
+		p = end;
+	}
+	sort(schedule, nr, sizeof(u32), cmp_u32, NULL);
+
+	/* 先让调度表失效，再清零序号和记录，避免半新半旧的组合命中 */
+	spin_lock_irq(&fail_replay_lock);
+	fail_replay_nr = 0;
+	smp_wmb();
+	memcpy(fail_replay_schedule, schedule, nr * sizeof(u32));
+	atomic_set(&fail_replay_index, 0);
+	fail_replay_logged = 0;
+	smp_wmb();
+	fail_replay_nr = nr;
+	spin_unlock_irq(&fail_replay_lock);
+
+	return count;
+}
+
+static const struct file_operations fail_replay_schedule_fops = {
+	.open		= fail_replay_schedule_open,
+	.read		= seq_read,
+	.write		= fail_replay_schedule_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* 按失败的先后顺序输出环形缓冲区中仍保留的记录 */
+static int fail_replay_log_show(struct seq_file *m, void *arg)
+{
+	struct fail_replay_record *log;
+	unsigned int first, last, i;
+
+	log = kmalloc(sizeof(fail_replay_log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+
+	spin_lock_irq(&fail_replay_lock);
+	memcpy(log, fail_replay_log, sizeof(fail_replay_log));
+	last = fail_replay_logged;
+	spin_unlock_irq(&fail_replay_lock);
+
+	first = last > FAIL_REPLAY_LOG ? last - FAIL_REPLAY_LOG : 0;
+	seq_printf(m, "index      order gfp        timestamp_ns     caller\n");
+	for (i = first; i < last; i++) {
+		struct fail_replay_record *r = &log[i % FAIL_REPLAY_LOG];
+
+		seq_printf(m, "%-10u %-5u 0x%08x %-16llu %pS\n",
+			   r->index, r->order, r->gfp_mask,
+			   (unsigned long long)r->timestamp, (void *)r->caller);
+	}
+	kfree(log);
+	return 0;
+}
+
+static int fail_replay_log_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fail_replay_log_show, NULL);
+}
+
+static const struct file_operations fail_replay_log_fops = {
+	.open		= fail_replay_log_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int __init fail_page_alloc_debugfs(void)
 {
 	umode_t mode = S_IFREG | S_IRUSR | S_IWUSR;
@@ -1515,6 +3656,42 @@ static int __init fail_page_alloc_debugfs(void)
 	if (!debugfs_create_u32("min-order", mode, dir,
 				&fail_page_alloc.min_order))
 		goto fail;
+	if (!debugfs_create_u32("inject-reclaim-fail", mode, dir,
+				&fail_page_alloc.inject_reclaim_fail))
+		goto fail;
+	if (!debugfs_create_u32("inject-compact-fail", mode, dir,
+				&fail_page_alloc.inject_compact_fail))
+		goto fail;
+	if (!debugfs_create_u32("max-order", mode, dir,
+				&fail_page_alloc.max_order))
+		goto fail;
+	if (!debugfs_create_x32("require-gfp", mode, dir,
+				&fail_page_alloc.require_gfp))
+		goto fail;
+	if (!debugfs_create_x32("ignore-gfp", mode, dir,
+				&fail_page_alloc.ignore_gfp))
+		goto fail;
+	if (!debugfs_create_x64("caller-start", mode, dir,
+				&fail_page_alloc.caller_start))
+		goto fail;
+	if (!debugfs_create_x64("caller-end", mode, dir,
+				&fail_page_alloc.caller_end))
+		goto fail;
+	if (!debugfs_create_bool("replay", mode, dir,
+				&fail_page_alloc.replay))
+		goto fail;
+	if (!debugfs_create_u32("replay-seed", mode, dir,
+				&fail_page_alloc.replay_seed))
+		goto fail;
+	if (!debugfs_create_u32("replay-period", mode, dir,
+				&fail_page_alloc.replay_period))
+		goto fail;
+	if (!debugfs_create_file("replay-schedule", mode, dir, NULL,
+				 &fail_replay_schedule_fops))
+		goto fail;
+	if (!debugfs_create_file("replay-log", S_IFREG | S_IRUSR, dir, NULL,
+				 &fail_replay_log_fops))
+		goto fail;
 
 	return 0;
 fail:
@@ -1529,11 +3706,22 @@ late_initcall(fail_page_alloc_debugfs);
 
 #else /* CONFIG_FAIL_PAGE_ALLOC */
 
-static inline int should_fail_alloc_page(gfp_t gfp_mask, unsigned int order)
+static inline int should_fail_alloc_page(gfp_t gfp_mask, unsigned int order,
+					 unsigned long caller)
 {
 	return 0;
 }
 
+static inline bool should_inject_reclaim_fail(void)
+{
+	return false;
+}
+
+static inline bool should_inject_compact_fail(unsigned int order)
+{
+	return false;
+}
+
 #endif /* CONFIG_FAIL_PAGE_ALLOC */
 
 /*
@@ -1837,7 +4025,8 @@ zonelist_scan:
 
 try_this_zone:
 		page = buffered_rmqueue(preferred_zone, zone, order,
-						gfp_mask, migratetype);
+						gfp_mask, migratetype,
+						alloc_flags_colour(alloc_flags));
 		if (page)
 			break;
 this_zone_full:
@@ -1871,9 +4060,379 @@ static DEFINE_RATELIMIT_STATE(nopage_rs,
 		DEFAULT_RATELIMIT_INTERVAL,
 		DEFAULT_RATELIMIT_BURST);
 
-void warn_alloc_failed(gfp_t gfp_mask, int order, const char *fmt, ...)
+/*
+ * 空闲区快照。分配失败时show_mem()要经过printk输出几十行，在慢速串口上
+ * 需要毫秒级的时间，而这正是系统已经有麻烦的时候。alloc_fail_snapshot=1
+ * 时，warn_alloc_failed()改为把各区的空闲信息以固定的二进制布局写入本
+ * CPU预先分配的缓冲区，只打印一行提示；最近一次快照可以从debugfs的
+ * page_alloc/free_area_snapshot读出（helloylt snapshot会把它渲染成文本）。
+ *
+ * 布局由用户空间解析，修改时必须增加FA_SNAPSHOT_MAGIC中的版本号。
+ */
+#define FA_SNAPSHOT_MAGIC	0x46415331	/* "FAS1" */
+#define FA_SNAPSHOT_ORDERS	16
+#define FA_SNAPSHOT_ZONES	32
+
+struct fa_snapshot_zone {
+	__u32 node;
+	__u32 zone_idx;
+	char name[8];
+	__u64 free_pages;
+	__u64 min;
+	__u64 low;
+	__u64 high;
+	__u64 present_pages;
+	__u32 nr_free[FA_SNAPSHOT_ORDERS];
+	/* 第t位表示free_list[t]非空 */
+	__u8 type_mask[FA_SNAPSHOT_ORDERS];
+};
+
+struct fa_snapshot {
+	__u32 magic;
+	__u32 seq;		/* 奇数表示正在写入 */
+	__u64 timestamp_ns;
+	__u32 cpu;
+	__u32 gfp_mask;
+	__u32 order;
+	__u32 nr_zones;
+	__u64 caller;
+	char comm[16];
+	struct fa_snapshot_zone zones[FA_SNAPSHOT_ZONES];
+};
+
+static u32 alloc_fail_snapshot __read_mostly;
+
+static int __init setup_alloc_fail_snapshot(char *str)
+{
+	alloc_fail_snapshot = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("alloc_fail_snapshot=", setup_alloc_fail_snapshot);
+
+static struct fa_snapshot __percpu *fa_snapshots;
+static int fa_snapshot_latest = -1;
+
+static int __init fa_snapshot_init(void)
+{
+	BUILD_BUG_ON(MAX_ORDER > FA_SNAPSHOT_ORDERS);
+	BUILD_BUG_ON(MIGRATE_TYPES > 8);
+
+	fa_snapshots = alloc_percpu(struct fa_snapshot);
+	return fa_snapshots ? 0 : -ENOMEM;
+}
+core_initcall(fa_snapshot_init);
+
+/* 不拿zone->lock，读到的是近似值；代价只和区数、阶数成正比 */
+static void take_free_area_snapshot(gfp_t gfp_mask, int order,
+				    unsigned long caller)
+{
+	struct fa_snapshot *snap;
+	struct zone *zone;
+	unsigned long flags;
+	int cpu, nr = 0;
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	snap = per_cpu_ptr(fa_snapshots, cpu);
+
+	snap->seq++;
+	smp_wmb();
+
+	snap->magic = FA_SNAPSHOT_MAGIC;
+	snap->timestamp_ns = local_clock();
+	snap->cpu = cpu;
+	snap->gfp_mask = gfp_mask;
+	snap->order = order;
+	snap->caller = caller;
+	memcpy(snap->comm, current->comm, sizeof(snap->comm));
+
+	for_each_populated_zone(zone) {
+		struct fa_snapshot_zone *z;
+		int o, t;
+
+		if (nr >= FA_SNAPSHOT_ZONES)
+			break;
+		z = &snap->zones[nr++];
+		memset(z, 0, sizeof(*z));
+		z->node = zone_to_nid(zone);
+		z->zone_idx = zone_idx(zone);
+		strncpy(z->name, zone->name, sizeof(z->name));
+		z->free_pages = zone_page_state(zone, NR_FREE_PAGES);
+		z->min = min_wmark_pages(zone);
+		z->low = low_wmark_pages(zone);
+		z->high = high_wmark_pages(zone);
+		z->present_pages = zone->present_pages;
+		for (o = 0; o < MAX_ORDER; o++) {
+			struct free_area *area = &zone->free_area[o];
+
+			z->nr_free[o] = area->nr_free;
+			for (t = 0; t < MIGRATE_TYPES; t++)
+				if (!list_empty(&area->free_list[t]))
+					z->type_mask[o] |= 1 << t;
+		}
+	}
+	snap->nr_zones = nr;
+
+	smp_wmb();
+	snap->seq++;
+	ACCESS_ONCE(fa_snapshot_latest) = cpu;
+	local_irq_restore(flags);
+}
+
+#ifdef CONFIG_DEBUG_FS
+/* 打开时复制一份一致的快照，之后的读都从副本进行 */
+static int fa_snapshot_open(struct inode *inode, struct file *file)
+{
+	struct fa_snapshot *snap, *copy;
+	int cpu = ACCESS_ONCE(fa_snapshot_latest);
+	int tries;
+	unsigned seq;
+
+	file->private_data = NULL;
+	if (cpu < 0 || !fa_snapshots)
+		return 0;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	snap = per_cpu_ptr(fa_snapshots, cpu);
+	for (tries = 0; tries < 3; tries++) {
+		seq = ACCESS_ONCE(snap->seq);
+		smp_rmb();
+		if (seq & 1)
+			continue;
+		memcpy(copy, snap, sizeof(*copy));
+		smp_rmb();
+		if (ACCESS_ONCE(snap->seq) == seq) {
+			file->private_data = copy;
+			return 0;
+		}
+	}
+
+	kfree(copy);
+	return -EAGAIN;
+}
+
+static ssize_t fa_snapshot_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	if (!file->private_data)
+		return 0;
+	return simple_read_from_buffer(buf, count, ppos, file->private_data,
+				       sizeof(struct fa_snapshot));
+}
+
+static int fa_snapshot_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations fa_snapshot_fops = {
+	.open		= fa_snapshot_open,
+	.read		= fa_snapshot_read,
+	.llseek		= default_llseek,
+	.release	= fa_snapshot_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
+/*
+ * 分配失败的聚合报告。突发的分配失败即使有nopage_rs限速，也会在慢速
+ * 串口上输出成批的栈和show_mem。alloc_fail_aggregate=1时，失败按
+ * (gfp类别, 阶, 调用点)计数，记录第一次和最后一次的时间，不在失败路径
+ * 上打印；由工作项每隔alloc_fail_digest_secs秒打印一次摘要，只包含
+ * 上次摘要以来有新失败的条目。/proc/allocfail列出全部条目。
+ */
+#define ALLOC_FAIL_BITS		6
+#define ALLOC_FAIL_ENTRIES	(1 << ALLOC_FAIL_BITS)
+#define ALLOC_FAIL_GFP_CLASS	(__GFP_WAIT | __GFP_IO | __GFP_FS | \
+				 __GFP_HIGH | GFP_ZONEMASK)
+
+struct alloc_fail_entry {
+	unsigned long caller;		/* 0表示空槽 */
+	gfp_t gfp_class;
+	int order;
+	unsigned long count;
+	unsigned long reported;		/* 截至上次摘要的count */
+	unsigned long first;		/* jiffies */
+	unsigned long last;
+};
+
+static u32 alloc_fail_aggregate __read_mostly;
+static u32 alloc_fail_digest_secs __read_mostly = 60;
+
+static int __init setup_alloc_fail_aggregate(char *str)
+{
+	alloc_fail_aggregate = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("alloc_fail_aggregate=", setup_alloc_fail_aggregate);
+
+static struct alloc_fail_entry alloc_fail_table[ALLOC_FAIL_ENTRIES];
+static unsigned long alloc_fail_dropped;
+static DEFINE_SPINLOCK(alloc_fail_lock);
+
+static void alloc_fail_digest(struct work_struct *work);
+static DECLARE_DELAYED_WORK(alloc_fail_digest_work, alloc_fail_digest);
+
+static void record_alloc_failure(gfp_t gfp_mask, int order,
+				 unsigned long caller)
+{
+	gfp_t gfp_class = gfp_mask & ALLOC_FAIL_GFP_CLASS;
+	unsigned long flags, hash;
+	int i;
+
+	hash = hash_long(caller ^ (gfp_class << 8) ^ order, ALLOC_FAIL_BITS);
+
+	spin_lock_irqsave(&alloc_fail_lock, flags);
+	for (i = 0; i < ALLOC_FAIL_ENTRIES; i++) {
+		struct alloc_fail_entry *e;
+
+		e = &alloc_fail_table[(hash + i) & (ALLOC_FAIL_ENTRIES - 1)];
+		if (!e->caller) {
+			e->caller = caller;
+			e->gfp_class = gfp_class;
+			e->order = order;
+			e->first = jiffies;
+		} else if (e->caller != caller || e->gfp_class != gfp_class ||
+			   e->order != order)
+			continue;
+
+		e->count++;
+		e->last = jiffies;
+		break;
+	}
+	if (i == ALLOC_FAIL_ENTRIES)
+		alloc_fail_dropped++;
+	spin_unlock_irqrestore(&alloc_fail_lock, flags);
+
+	schedule_delayed_work(&alloc_fail_digest_work,
+			      alloc_fail_digest_secs * HZ);
+}
+
+static const char *alloc_fail_class_name(gfp_t gfp_class)
+{
+	if (!(gfp_class & __GFP_WAIT))
+		return "atomic";
+	if (!(gfp_class & __GFP_IO))
+		return "noio";
+	if (!(gfp_class & __GFP_FS))
+		return "nofs";
+	return "kernel";
+}
+
+static void alloc_fail_digest(struct work_struct *work)
+{
+	/* 太大，不能放在栈上；只有这个工作项使用它 */
+	static struct alloc_fail_entry snap[ALLOC_FAIL_ENTRIES];
+	unsigned long dropped;
+	int i, nr = 0;
+
+	/* 在锁内只做复制，打印放到锁外 */
+	spin_lock_irq(&alloc_fail_lock);
+	for (i = 0; i < ALLOC_FAIL_ENTRIES; i++) {
+		struct alloc_fail_entry *e = &alloc_fail_table[i];
+
+		if (!e->caller || e->count == e->reported)
+			continue;
+		snap[nr] = *e;
+		snap[nr++].reported = e->count - e->reported;
+		e->reported = e->count;
+	}
+	dropped = alloc_fail_dropped;
+	spin_unlock_irq(&alloc_fail_lock);
+
+	for (i = 0; i < nr; i++)
+		pr_warn("page allocation failures: %lu new (%lu total) "
+			"order:%d %s mode:0x%x caller %pS, "
+			"first %lus ago, last %lus ago\n",
+			snap[i].reported, snap[i].count, snap[i].order,
+			alloc_fail_class_name(snap[i].gfp_class),
+			snap[i].gfp_class, (void *)snap[i].caller,
+			(jiffies - snap[i].first) / HZ,
+			(jiffies - snap[i].last) / HZ);
+	if (nr && dropped)
+		pr_warn("page allocation failures: %lu not tracked, "
+			"table full\n", dropped);
+}
+
+static int alloc_fail_proc_show(struct seq_file *m, void *arg)
+{
+	struct alloc_fail_entry *snap;
+	unsigned long dropped;
+	int i;
+
+	snap = kmalloc(sizeof(alloc_fail_table), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	spin_lock_irq(&alloc_fail_lock);
+	memcpy(snap, alloc_fail_table, sizeof(alloc_fail_table));
+	dropped = alloc_fail_dropped;
+	spin_unlock_irq(&alloc_fail_lock);
+
+	seq_printf(m, "%10s %5s %-6s %10s %10s %10s  %s\n", "count", "order",
+		   "class", "mode", "first(s)", "last(s)", "caller");
+	for (i = 0; i < ALLOC_FAIL_ENTRIES; i++) {
+		if (!snap[i].caller)
+			continue;
+		seq_printf(m, "%10lu %5d %-6s %#10x %10lu %10lu  %pS\n",
+			   snap[i].count, snap[i].order,
+			   alloc_fail_class_name(snap[i].gfp_class),
+			   snap[i].gfp_class,
+			   (jiffies - snap[i].first) / HZ,
+			   (jiffies - snap[i].last) / HZ,
+			   (void *)snap[i].caller);
+	}
+	seq_printf(m, "untracked %lu\n", dropped);
+
+	kfree(snap);
+	return 0;
+}
+
+static int alloc_fail_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, alloc_fail_proc_show, NULL);
+}
+
+static const struct file_operations alloc_fail_proc_fops = {
+	.open		= alloc_fail_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init alloc_fail_proc_init(void)
+{
+	proc_create("allocfail", S_IRUSR, NULL, &alloc_fail_proc_fops);
+	return 0;
+}
+module_init(alloc_fail_proc_init);
+
+/* caller是分配器入口的返回地址，见alloc_caller() */
+static void __warn_alloc_failed(gfp_t gfp_mask, int order,
+				unsigned long caller, struct va_format *vaf)
 {
 	unsigned int filter = SHOW_MEM_FILTER_NODES;
+	bool snapshot = false;
+
+	if (!(gfp_mask & __GFP_NOWARN) &&
+	    ((alloc_fail_snapshot && fa_snapshots) || alloc_fail_aggregate))
+		caller = alloc_caller(caller);
+
+	/* 快照很便宜，不受限速的影响 */
+	if (alloc_fail_snapshot && fa_snapshots &&
+	    !(gfp_mask & __GFP_NOWARN)) {
+		take_free_area_snapshot(gfp_mask, order, caller);
+		snapshot = true;
+	}
+
+	if (alloc_fail_aggregate) {
+		if (!(gfp_mask & __GFP_NOWARN))
+			record_alloc_failure(gfp_mask, order, caller);
+		return;
+	}
 
 	if ((gfp_mask & __GFP_NOWARN) || !__ratelimit(&nopage_rs) ||
 	    debug_guardpage_minorder() > 0)
@@ -1898,28 +4457,39 @@ void warn_alloc_failed(gfp_t gfp_mask, int order, const char *fmt, ...)
 	if (in_interrupt() || !(gfp_mask & __GFP_WAIT))
 		filter &= ~SHOW_MEM_FILTER_NODES;
 
-	if (fmt) {
-		struct va_format vaf;
-		va_list args;
-
-		va_start(args, fmt);
-
-		vaf.fmt = fmt;
-		vaf.va = &args;
-
-		pr_warn("%pV", &vaf);
-
-		va_end(args);
-	}
+	if (vaf)
+		pr_warn("%pV", vaf);
 
 	pr_warn("%s: page allocation failure: order:%d, mode:0x%x\n",
 		current->comm, order, gfp_mask);
 
+	if (snapshot) {
+		pr_warn("free area snapshot saved, see page_alloc/free_area_snapshot\n");
+		return;
+	}
+
 	dump_stack();
 	if (!should_suppress_show_mem())
 		show_mem(filter);
 }
 
+void warn_alloc_failed(gfp_t gfp_mask, int order, const char *fmt, ...)
+{
+	struct va_format vaf;
+	va_list args;
+
+	if (!fmt) {
+		__warn_alloc_failed(gfp_mask, order, _RET_IP_, NULL);
+		return;
+	}
+
+	va_start(args, fmt);
+	vaf.fmt = fmt;
+	vaf.va = &args;
+	__warn_alloc_failed(gfp_mask, order, _RET_IP_, &vaf);
+	va_end(args);
+}
+
 static inline int
 should_alloc_retry(gfp_t gfp_mask, unsigned int order,
 				unsigned long did_some_progress,
@@ -2174,6 +4744,87 @@ __alloc_pages_high_priority(gfp_t gfp_mask, unsigned int order,
 	return page;
 }
 
+/*
+ * kswapd唤醒合并。突发负载下每次进入慢速路径都会遍历整个分区列表去唤醒
+ * kswapd，而kswapd多半早已醒着。每个区记录当前间隔内已经请求过的最高阶
+ * 和最低classzone，被这次唤醒覆盖的请求直接跳过；阶更高或classzone更低
+ * 的请求照常唤醒并扩大记录。默认间隔为0，不做合并。
+ *
+ * 开始时间、阶和classzone压在同一个字里用cmpxchg更新：一个请求只有在
+ * 某次成功的cmpxchg装入了覆盖它的记录之后才会被跳过，而装入记录的
+ * CPU自己一定会发出这次唤醒。开始时间只保留低位，回绕后恰好落进
+ * 间隔的旧记录会让一次唤醒被跳过，这个概率可以忽略。
+ */
+#define KSWAPD_WAKE_CZ_BITS	3
+#define KSWAPD_WAKE_ORDER_BITS	5
+#define KSWAPD_WAKE_STAMP_SHIFT	(KSWAPD_WAKE_CZ_BITS + KSWAPD_WAKE_ORDER_BITS)
+#define KSWAPD_WAKE_STAMP_MASK	(~0UL >> KSWAPD_WAKE_STAMP_SHIFT)
+
+static u32 kswapd_wake_interval_ms __read_mostly;
+
+static int __init setup_kswapd_wake_interval(char *str)
+{
+	kswapd_wake_interval_ms = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("kswapd_wake_interval_ms=", setup_kswapd_wake_interval);
+
+struct kswapd_wake_stats {
+	unsigned long issued;
+	unsigned long coalesced;
+};
+static DEFINE_PER_CPU(struct kswapd_wake_stats, kswapd_wake_stats);
+
+static inline unsigned long kswapd_wake_pack(unsigned long stamp,
+					     unsigned int order,
+					     enum zone_type classzone_idx)
+{
+	return ((stamp & KSWAPD_WAKE_STAMP_MASK) << KSWAPD_WAKE_STAMP_SHIFT) |
+	       (order << KSWAPD_WAKE_CZ_BITS) | classzone_idx;
+}
+
+static bool kswapd_wake_coalesce(struct zone *zone, unsigned int order,
+				 enum zone_type classzone_idx)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	unsigned long interval = msecs_to_jiffies(kswapd_wake_interval_ms);
+	unsigned long now = jiffies;
+	unsigned long old, new;
+
+	BUILD_BUG_ON(MAX_NR_ZONES > (1 << KSWAPD_WAKE_CZ_BITS));
+	BUILD_BUG_ON(MAX_ORDER > (1 << KSWAPD_WAKE_ORDER_BITS));
+
+	if (!kswapd_wake_interval_ms)
+		return false;
+
+	do {
+		unsigned long stamp, w_order, w_cz;
+
+		old = ACCESS_ONCE(ext->kswapd_wake_state);
+		stamp = old >> KSWAPD_WAKE_STAMP_SHIFT;
+		w_order = (old >> KSWAPD_WAKE_CZ_BITS) &
+			  ((1 << KSWAPD_WAKE_ORDER_BITS) - 1);
+		w_cz = old & ((1 << KSWAPD_WAKE_CZ_BITS) - 1);
+
+		if (old &&
+		    ((now - stamp) & KSWAPD_WAKE_STAMP_MASK) < interval) {
+			/* 本间隔内的唤醒已经覆盖了这个请求 */
+			if (order <= w_order && classzone_idx >= w_cz)
+				return true;
+			/* 需要更大的唤醒，扩大记录但保留间隔的开始时间 */
+			new = kswapd_wake_pack(stamp, max_t(unsigned long,
+							    order, w_order),
+					       min_t(unsigned long,
+						     classzone_idx, w_cz));
+		} else {
+			/* 新的间隔 */
+			new = kswapd_wake_pack(now, order, classzone_idx);
+		}
+	} while (cmpxchg(&ext->kswapd_wake_state, old, new) != old);
+
+	return false;
+}
+
 static inline
 void wake_all_kswapd(unsigned int order, struct zonelist *zonelist,
 						enum zone_type high_zoneidx,
@@ -2182,10 +4833,43 @@ void wake_all_kswapd(unsigned int order, struct zonelist *zonelist,
 	struct zoneref *z;
 	struct zone *zone;
 
-	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx)
+	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx) {
+		if (kswapd_wake_coalesce(zone, order, classzone_idx)) {
+			this_cpu_inc(kswapd_wake_stats.coalesced);
+			continue;
+		}
+		this_cpu_inc(kswapd_wake_stats.issued);
 		wakeup_kswapd(zone, order, classzone_idx);
+	}
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int kswapd_wake_show(struct seq_file *m, void *arg)
+{
+	unsigned long issued = 0, coalesced = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		issued += per_cpu(kswapd_wake_stats, cpu).issued;
+		coalesced += per_cpu(kswapd_wake_stats, cpu).coalesced;
+	}
+	seq_printf(m, "issued    %lu\ncoalesced %lu\n", issued, coalesced);
+	return 0;
+}
+
+static int kswapd_wake_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kswapd_wake_show, NULL);
 }
 
+static const struct file_operations kswapd_wake_fops = {
+	.open		= kswapd_wake_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 static inline int
 gfp_to_alloc_flags(gfp_t gfp_mask)
 {
@@ -2228,11 +4912,240 @@ gfp_to_alloc_flags(gfp_t gfp_mask)
 	return alloc_flags;
 }
 
-static inline struct page *
-__alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
+/*
+ * 慢速路径剖析。打开slowpath_profile后，每次进入__alloc_pages_slowpath
+ * 都记录经过的各个阶段、每个阶段的耗时和结果。记录放在单独的noinline
+ * 函数的栈帧里，没有打开剖析时慢速路径的栈上没有这份记录。结束时把每个阶段的
+ * 耗时累加进按CPU的直方图（以2为底的纳秒对数分桶），总耗时最长的
+ * SLOWPATH_WORST次记录连同完整的阶段序列保存下来，可以从debugfs读出。
+ */
+enum slowpath_stage {
+	SP_WAKE_KSWAPD,
+	SP_FREELIST,
+	SP_HIGH_PRIORITY,
+	SP_COMPACT,
+	SP_RECLAIM,
+	SP_OOM,
+	SP_RETRY_WAIT,
+	SP_TOTAL,
+	NR_SLOWPATH_STAGES
+};
+
+static const char * const slowpath_stage_names[NR_SLOWPATH_STAGES] = {
+	[SP_WAKE_KSWAPD]	= "wake_kswapd",
+	[SP_FREELIST]		= "freelist",
+	[SP_HIGH_PRIORITY]	= "high_priority",
+	[SP_COMPACT]		= "compact",
+	[SP_RECLAIM]		= "reclaim",
+	[SP_OOM]		= "oom",
+	[SP_RETRY_WAIT]		= "retry_wait",
+	[SP_TOTAL]		= "total",
+};
+
+#define SLOWPATH_TRACE_STEPS	16
+#define SLOWPATH_HIST_BUCKETS	32
+#define SLOWPATH_WORST		8
+
+struct slowpath_step {
+	u8 stage;
+	u8 success;
+	u32 ns;
+};
+
+struct slowpath_trace {
+	u64 start;
+	u64 total_ns;
+	gfp_t gfp_mask;
+	unsigned int order;
+	int nr_steps;		/* 可能大于SLOWPATH_TRACE_STEPS，多出的没有记录 */
+	struct slowpath_step steps[SLOWPATH_TRACE_STEPS];
+};
+
+struct slowpath_stage_stats {
+	unsigned long calls;
+	unsigned long success;
+	u64 ns;
+	unsigned long hist[SLOWPATH_HIST_BUCKETS];
+};
+
+static u32 slowpath_profile __read_mostly;
+static DEFINE_PER_CPU(struct slowpath_stage_stats [NR_SLOWPATH_STAGES],
+		      slowpath_stats);
+static struct slowpath_trace slowpath_worst[SLOWPATH_WORST];
+static DEFINE_SPINLOCK(slowpath_worst_lock);
+
+static int __init setup_slowpath_profile(char *str)
+{
+	slowpath_profile = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("slowpath_profile=", setup_slowpath_profile);
+
+static void slowpath_account(int stage, u64 ns, bool success)
+{
+	struct slowpath_stage_stats *stats;
+
+	preempt_disable();
+	stats = &__get_cpu_var(slowpath_stats)[stage];
+	stats->calls++;
+	stats->success += success;
+	stats->ns += ns;
+	stats->hist[min(fls64(ns), SLOWPATH_HIST_BUCKETS - 1)]++;
+	preempt_enable();
+}
+
+static inline void slowpath_trace_start(struct slowpath_trace *sp,
+					gfp_t gfp_mask, unsigned int order)
+{
+	if (!sp)
+		return;
+	sp->start = local_clock();
+	sp->gfp_mask = gfp_mask;
+	sp->order = order;
+	sp->nr_steps = 0;
+}
+
+static inline u64 slowpath_stage_start(struct slowpath_trace *sp)
+{
+	return sp ? local_clock() : 0;
+}
+
+static void slowpath_stage_end(struct slowpath_trace *sp, int stage,
+			       u64 start, bool success)
+{
+	u64 ns;
+
+	if (!sp)
+		return;
+
+	ns = local_clock() - start;
+	slowpath_account(stage, ns, success);
+	if (sp->nr_steps < SLOWPATH_TRACE_STEPS) {
+		struct slowpath_step *step = &sp->steps[sp->nr_steps];
+
+		step->stage = stage;
+		step->success = success;
+		step->ns = min_t(u64, ns, U32_MAX);
+	}
+	sp->nr_steps++;
+}
+
+static void slowpath_trace_finish(struct slowpath_trace *sp, bool success)
+{
+	unsigned long flags;
+	int i, victim = 0;
+
+	if (!sp)
+		return;
+
+	sp->total_ns = local_clock() - sp->start;
+	slowpath_account(SP_TOTAL, sp->total_ns, success);
+
+	/* 替换掉保存的记录里耗时最短的那一条 */
+	spin_lock_irqsave(&slowpath_worst_lock, flags);
+	for (i = 1; i < SLOWPATH_WORST; i++)
+		if (slowpath_worst[i].total_ns < slowpath_worst[victim].total_ns)
+			victim = i;
+	if (sp->total_ns > slowpath_worst[victim].total_ns)
+		slowpath_worst[victim] = *sp;
+	spin_unlock_irqrestore(&slowpath_worst_lock, flags);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int slowpath_stats_show(struct seq_file *m, void *arg)
+{
+	int cpu, stage, i;
+
+	for (stage = 0; stage < NR_SLOWPATH_STAGES; stage++) {
+		struct slowpath_stage_stats sum;
+
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			struct slowpath_stage_stats *stats;
+
+			stats = &per_cpu(slowpath_stats, cpu)[stage];
+			sum.calls += stats->calls;
+			sum.success += stats->success;
+			sum.ns += stats->ns;
+			for (i = 0; i < SLOWPATH_HIST_BUCKETS; i++)
+				sum.hist[i] += stats->hist[i];
+		}
+		seq_printf(m, "%-14s calls %lu success %lu ns %llu\n",
+			   slowpath_stage_names[stage], sum.calls,
+			   sum.success, (unsigned long long)sum.ns);
+		/* 第i桶计数的是耗时在[2^(i-1), 2^i)纳秒内的阶段 */
+		seq_puts(m, "  hist");
+		for (i = 0; i < SLOWPATH_HIST_BUCKETS; i++)
+			seq_printf(m, " %lu", sum.hist[i]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int slowpath_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, slowpath_stats_show, NULL);
+}
+
+static const struct file_operations slowpath_stats_fops = {
+	.open		= slowpath_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int slowpath_worst_show(struct seq_file *m, void *arg)
+{
+	struct slowpath_trace *worst;
+	int i, j;
+
+	worst = kmalloc(sizeof(slowpath_worst), GFP_KERNEL);
+	if (!worst)
+		return -ENOMEM;
+
+	spin_lock_irq(&slowpath_worst_lock);
+	memcpy(worst, slowpath_worst, sizeof(slowpath_worst));
+	spin_unlock_irq(&slowpath_worst_lock);
+
+	for (i = 0; i < SLOWPATH_WORST; i++) {
+		struct slowpath_trace *sp = &worst[i];
+
+		if (!sp->total_ns)
+			continue;
+		seq_printf(m, "total %llu ns order %u mode 0x%x steps %d:",
+			   (unsigned long long)sp->total_ns, sp->order,
+			   sp->gfp_mask, sp->nr_steps);
+		for (j = 0; j < min(sp->nr_steps, SLOWPATH_TRACE_STEPS); j++)
+			seq_printf(m, " %s%s/%u",
+				   slowpath_stage_names[sp->steps[j].stage],
+				   sp->steps[j].success ? "+" : "-",
+				   sp->steps[j].ns);
+		if (sp->nr_steps > SLOWPATH_TRACE_STEPS)
+			seq_puts(m, " ...");
+		seq_putc(m, '\n');
+	}
+	kfree(worst);
+	return 0;
+}
+
+static int slowpath_worst_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, slowpath_worst_show, NULL);
+}
+
+static const struct file_operations slowpath_worst_fops = {
+	.open		= slowpath_worst_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
+static struct page *
+__do_alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
 	struct zonelist *zonelist, enum zone_type high_zoneidx,
 	nodemask_t *nodemask, struct zone *preferred_zone,
-	int migratetype)
+	int migratetype, unsigned long caller, struct slowpath_trace *sp)
 {
 	const gfp_t wait = gfp_mask & __GFP_WAIT;
 	struct page *page = NULL;
@@ -2241,6 +5154,7 @@ __alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
 	unsigned long did_some_progress;
 	bool sync_migration = false;
 	bool deferred_compaction = false;
+	u64 t;
 
 	/*
 	 * 在慢速路径中，我们进行了理智的检查，以避免曾经试图
@@ -2253,6 +5167,8 @@ __alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
 		return NULL;
 	}
 
+	slowpath_trace_start(sp, gfp_mask, order);
+
 	/*
 	 * GFP_THISNODE（指__GFP_THISNODE、__GFP_NORETRY和
 	 * __GFP_NOWARN设置）不应该导致回收，因为使用GFP_THISNODE的子系统
@@ -2264,10 +5180,17 @@ __alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
 	if (NUMA_BUILD && (gfp_mask & GFP_THISNODE) == GFP_THISNODE)
 		goto nopage;
 
+	/* 高阶原子分配的需求历史决定了MIGRATE_RESERVE的大小 */
+	if (!wait && order)
+		note_atomic_reserve_demand(preferred_zone, order);
+
 restart:
-	if (!(gfp_mask & __GFP_NO_KSWAPD))
+	if (!(gfp_mask & __GFP_NO_KSWAPD)) {
+		t = slowpath_stage_start(sp);
 		wake_all_kswapd(order, zonelist, high_zoneidx,
 						zone_idx(preferred_zone));
+		slowpath_stage_end(sp, SP_WAKE_KSWAPD, t, true);
+	}
 
 	/*
 	 * 好了，我们在kswapd的水印下面，已经踢到了背景
@@ -2286,17 +5209,21 @@ restart:
 
 rebalance:
 	/* 这是最后的机会，一般来说，在goto nopage之前。*/
+	t = slowpath_stage_start(sp);
 	page = get_page_from_freelist(gfp_mask, nodemask, order, zonelist,
 			high_zoneidx, alloc_flags & ~ALLOC_NO_WATERMARKS,
 			preferred_zone, migratetype);
+	slowpath_stage_end(sp, SP_FREELIST, t, page);
 	if (page)
 		goto got_pg;
 
 	/* 如果环境允许，分配时不加水印 */
 	if (alloc_flags & ALLOC_NO_WATERMARKS) {
+		t = slowpath_stage_start(sp);
 		page = __alloc_pages_high_priority(gfp_mask, order,
 				zonelist, high_zoneidx, nodemask,
 				preferred_zone, migratetype);
+		slowpath_stage_end(sp, SP_HIGH_PRIORITY, t, page);
 		if (page)
 			goto got_pg;
 	}
@@ -2317,13 +5244,19 @@ rebalance:
 	 * 尝试直接压实。第一遍是异步的。后续的
 	 * 直接回收后的尝试是同步的
 	 */
-	page = __alloc_pages_direct_compact(gfp_mask, order,
+	t = slowpath_stage_start(sp);
+	if (should_inject_compact_fail(order)) {
+		page = NULL;
+		did_some_progress = COMPACT_SKIPPED;
+	} else
+		page = __alloc_pages_direct_compact(gfp_mask, order,
 					zonelist, high_zoneidx,
 					nodemask,
 					alloc_flags, preferred_zone,
 					migratetype, sync_migration,
 					&deferred_compaction,
 					&did_some_progress);
+	slowpath_stage_end(sp, SP_COMPACT, t, page);
 	if (page)
 		goto got_pg;
 	sync_migration = true;
@@ -2338,11 +5271,17 @@ rebalance:
 		goto nopage;
 
 	/* 尝试直接回收，然后分配 */
-	page = __alloc_pages_direct_reclaim(gfp_mask, order,
+	t = slowpath_stage_start(sp);
+	if (should_inject_reclaim_fail()) {
+		page = NULL;
+		did_some_progress = 0;
+	} else
+		page = __alloc_pages_direct_reclaim(gfp_mask, order,
 					zonelist, high_zoneidx,
 					nodemask,
 					alloc_flags, preferred_zone,
 					migratetype, &did_some_progress);
+	slowpath_stage_end(sp, SP_RECLAIM, t, page);
 	if (page)
 		goto got_pg;
 
@@ -2358,10 +5297,12 @@ rebalance:
 			if ((current->flags & PF_DUMPCORE) &&
 			    !(gfp_mask & __GFP_NOFAIL))
 				goto nopage;
+			t = slowpath_stage_start(sp);
 			page = __alloc_pages_may_oom(gfp_mask, order,
 					zonelist, high_zoneidx,
 					nodemask, preferred_zone,
 					migratetype);
+			slowpath_stage_end(sp, SP_OOM, t, page);
 			if (page)
 				goto got_pg;
 
@@ -2392,7 +5333,9 @@ rebalance:
 	if (should_alloc_retry(gfp_mask, order, did_some_progress,
 						pages_reclaimed)) {
 		/* 等待一些写请求完成后重试 */
+		t = slowpath_stage_start(sp);
 		wait_iff_congested(preferred_zone, BLK_RW_ASYNC, HZ/50);
+		slowpath_stage_end(sp, SP_RETRY_WAIT, t, true);
 		goto rebalance;
 	} else {
 		/*
@@ -2400,27 +5343,234 @@ rebalance:
 		 * 直接回收和回收/压实取决于压实。
 		 * 在回收后被调用，所以必要时直接调用
 		 */
-		page = __alloc_pages_direct_compact(gfp_mask, order,
+		t = slowpath_stage_start(sp);
+		if (should_inject_compact_fail(order)) {
+			page = NULL;
+			did_some_progress = COMPACT_SKIPPED;
+		} else
+			page = __alloc_pages_direct_compact(gfp_mask, order,
 					zonelist, high_zoneidx,
 					nodemask,
 					alloc_flags, preferred_zone,
 					migratetype, sync_migration,
 					&deferred_compaction,
 					&did_some_progress);
+		slowpath_stage_end(sp, SP_COMPACT, t, page);
 		if (page)
 			goto got_pg;
 	}
 
 nopage:
-	warn_alloc_failed(gfp_mask, order, NULL);
+	slowpath_trace_finish(sp, false);
+	__warn_alloc_failed(gfp_mask, order, caller, NULL);
 	return page;
 got_pg:
+	slowpath_trace_finish(sp, true);
 	if (kmemcheck_enabled)
 		kmemcheck_pagealloc_alloc(page, order, gfp_mask);
 	return page;
 
 }
 
+/* 剖析用的记录只在这一帧里，不占用普通慢速路径的栈 */
+static noinline struct page *
+__alloc_pages_slowpath_traced(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, struct zone *preferred_zone,
+	int migratetype, unsigned long caller)
+{
+	struct slowpath_trace trace;
+
+	return __do_alloc_pages_slowpath(gfp_mask, order, zonelist,
+			high_zoneidx, nodemask, preferred_zone,
+			migratetype, caller, &trace);
+}
+
+static inline struct page *
+__alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, struct zone *preferred_zone,
+	int migratetype, unsigned long caller)
+{
+	if (unlikely(slowpath_profile))
+		return __alloc_pages_slowpath_traced(gfp_mask, order,
+				zonelist, high_zoneidx, nodemask,
+				preferred_zone, migratetype, caller);
+	return __do_alloc_pages_slowpath(gfp_mask, order, zonelist,
+			high_zoneidx, nodemask, preferred_zone,
+			migratetype, caller, NULL);
+}
+
+/*
+ * 高阶原子分配的快速失败模式。原子分配不能回收也不能压缩，如果分区列表
+ * 里没有一个区在该阶或更高阶上有空闲块，慢速路径注定失败。打开这个模式后，
+ * __alloc_pages_nodemask在扫描分区列表之前先查看各区的free_order_mask，
+ * 直接返回NULL，由调用者退回到小块分配（例如分片的skb）。
+ */
+static u32 atomic_fastfail __read_mostly;
+
+static int __init setup_atomic_fastfail(char *str)
+{
+	atomic_fastfail = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("atomic_fastfail=", setup_atomic_fastfail);
+
+struct atomic_fastfail_stats {
+	unsigned long checked[PAGE_ALLOC_COSTLY_ORDER + 1];
+	unsigned long failed[PAGE_ALLOC_COSTLY_ORDER + 1];
+};
+static DEFINE_PER_CPU(struct atomic_fastfail_stats, atomic_fastfail_stats);
+
+static bool zonelist_has_free_order(struct zonelist *zonelist,
+				    enum zone_type high_zoneidx,
+				    nodemask_t *nodemask, unsigned int order)
+{
+	struct zoneref *z;
+	struct zone *zone;
+
+	for_each_zone_zonelist_nodemask(zone, z, zonelist,
+					high_zoneidx, nodemask) {
+		if (ACCESS_ONCE(zone_ext(zone)->free_order_mask) >> order)
+			return true;
+		if (hpcp_has_order(zone, order))
+			return true;
+	}
+	return false;
+}
+
+static inline bool should_fastfail_atomic(gfp_t gfp_mask, unsigned int order,
+				struct zonelist *zonelist,
+				enum zone_type high_zoneidx, nodemask_t *nodemask)
+{
+	if (!atomic_fastfail || !order || order > PAGE_ALLOC_COSTLY_ORDER)
+		return false;
+	if (gfp_mask & (__GFP_WAIT | __GFP_NOFAIL))
+		return false;
+
+	this_cpu_inc(atomic_fastfail_stats.checked[order]);
+	if (zonelist_has_free_order(zonelist, high_zoneidx, nodemask, order))
+		return false;
+
+	this_cpu_inc(atomic_fastfail_stats.failed[order]);
+	return true;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int atomic_fastfail_show(struct seq_file *m, void *arg)
+{
+	int cpu, order;
+
+	seq_printf(m, "%-6s %12s %12s\n", "order", "checked", "failed");
+	for (order = 1; order <= PAGE_ALLOC_COSTLY_ORDER; order++) {
+		unsigned long checked = 0, failed = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct atomic_fastfail_stats *stats;
+
+			stats = &per_cpu(atomic_fastfail_stats, cpu);
+			checked += stats->checked[order];
+			failed += stats->failed[order];
+		}
+		seq_printf(m, "%-6d %12lu %12lu\n", order, checked, failed);
+	}
+	return 0;
+}
+
+static int atomic_fastfail_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, atomic_fastfail_show, NULL);
+}
+
+static const struct file_operations atomic_fastfail_fops = {
+	.open		= atomic_fastfail_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
+/*
+ * 启动之后重建的分区列表不再写回pgdat->node_zonelists。每个节点的新列表
+ * 建在单独分配的缓冲区里，用rcu_assign_pointer()发布到
+ * node_zonelists_live[]，旧缓冲区在synchronize_srcu()之后才释放，见
+ * publish_zonelists()。pgdat里启动时建立的列表从此不再改动，仍在用它的
+ * 读者看到的是过时但完整的列表。
+ *
+ * 分配路径在zonelist_read_lock()和zonelist_read_unlock()之间把指向
+ * pgdat->node_zonelists的指针换成已发布的列表，回收、压缩和OOM都可能
+ * 睡眠，所以用SRCU。还没有发布过列表时读者不进入SRCU，快速路径上
+ * 只多读一次zonelists_published。
+ */
+static struct zonelist __rcu *node_zonelists_live[MAX_NUMNODES];
+static struct srcu_struct zonelist_srcu;
+static bool zonelists_published __read_mostly;
+static DEFINE_PER_CPU(unsigned long, zonelist_remaps);
+
+/* 返回值交给zonelist_read_unlock()和node_zonelist_live() */
+int zonelist_read_lock(void)
+{
+	if (!ACCESS_ONCE(zonelists_published))
+		return -1;
+	/* 与publish_zonelists()中的smp_wmb()配对 */
+	smp_rmb();
+	return srcu_read_lock(&zonelist_srcu);
+}
+EXPORT_SYMBOL(zonelist_read_lock);
+
+void zonelist_read_unlock(int idx)
+{
+	if (idx >= 0)
+		srcu_read_unlock(&zonelist_srcu, idx);
+}
+EXPORT_SYMBOL(zonelist_read_unlock);
+
+static inline bool zonelist_in_node(struct zonelist *zonelist, int nid)
+{
+	struct zonelist *base = NODE_DATA(nid)->node_zonelists;
+
+	return zonelist >= base && zonelist < base + MAX_ZONELISTS;
+}
+
+/* node_zonelist()的重建安全版本，只能在读临界区内使用 */
+struct zonelist *node_zonelist_live(int nid, gfp_t flags, int idx)
+{
+	struct zonelist *zonelists = NULL;
+
+	if (idx >= 0)
+		zonelists = srcu_dereference(node_zonelists_live[nid],
+					     &zonelist_srcu);
+	if (!zonelists)
+		zonelists = NODE_DATA(nid)->node_zonelists;
+	return zonelists + gfp_zonelist(flags);
+}
+EXPORT_SYMBOL(node_zonelist_live);
+
+/*
+ * 调用者传进来的zonelist指向某个pgdat->node_zonelists时，换成该节点
+ * 已发布的列表；mempolicy自己建的列表原样返回。
+ */
+static struct zonelist *zonelist_remap(struct zonelist *zonelist, int idx)
+{
+	struct zonelist *live;
+	int nid = numa_node_id();
+
+	if (idx < 0)
+		return zonelist;
+	if (!zonelist_in_node(zonelist, nid)) {
+		for_each_online_node(nid)
+			if (zonelist_in_node(zonelist, nid))
+				break;
+		if (nid >= MAX_NUMNODES)
+			return zonelist;
+	}
+	live = srcu_dereference(node_zonelists_live[nid], &zonelist_srcu);
+	if (!live)
+		return zonelist;
+	this_cpu_inc(zonelist_remaps);
+	return live + (zonelist - NODE_DATA(nid)->node_zonelists);
+}
+
 /*
  *这是分区好友分配器的 "核心"。
  */
@@ -2433,6 +5583,7 @@ __alloc_pages_nodemask(gfp_t gfp_mask, unsigned int order,
 	struct page *page = NULL;
 	int migratetype = allocflags_to_migratetype(gfp_mask);
 	unsigned int cpuset_mems_cookie;
+	int zonelist_idx;
 
 	gfp_mask &= gfp_allowed_mask;
 
@@ -2440,19 +5591,23 @@ __alloc_pages_nodemask(gfp_t gfp_mask, unsigned int order,
 
 	might_sleep_if(gfp_mask & __GFP_WAIT);
 
-	if (should_fail_alloc_page(gfp_mask, order))
+	if (should_fail_alloc_page(gfp_mask, order, _RET_IP_))
 		return NULL;
 
+	/* 慢速路径里的回收、压缩和OOM也都走这份列表 */
+	zonelist_idx = zonelist_read_lock();
+	zonelist = zonelist_remap(zonelist, zonelist_idx);
+
+retry_cpuset:
+	cpuset_mems_cookie = get_mems_allowed();
+
 	/*
 	 * 检查适合gfp_mask的区域，至少包含一个
 	 *有效的区域。有可能因为GFP_THISNODE和无记忆节点的结果而出现一个空的分区列表。
 	 * GFP_THISNODE和一个无记忆的节点的结果。
 	 */
 	if (unlikely(!zonelist->_zonerefs->zone))
-		return NULL;
-
-retry_cpuset:
-	cpuset_mems_cookie = get_mems_allowed();
+		goto out;
 
 	/* 首选区域用于以后的统计工作 */
 	first_zones_zonelist(zonelist, high_zoneidx,
@@ -2461,6 +5616,20 @@ retry_cpuset:
 	if (!preferred_zone)
 		goto out;
 
+	if (should_fastfail_atomic(gfp_mask, order, zonelist,
+				   high_zoneidx, nodemask)) {
+		/*
+		 * 快速失败的请求不会进入慢速路径，在这里记下需求，否则
+		 * 保留区永远看不到这些原子高阶分配。仍然唤醒kswapd，让它
+		 * 为以后的高阶分配腾出空间
+		 */
+		note_atomic_reserve_demand(preferred_zone, order);
+		if (!(gfp_mask & __GFP_NO_KSWAPD))
+			wake_all_kswapd(order, zonelist, high_zoneidx,
+					zone_idx(preferred_zone));
+		goto out;
+	}
+
 	/* 第一次分配尝试 */
 	page = get_page_from_freelist(gfp_mask|__GFP_HARDWALL, nodemask, order,
 			zonelist, high_zoneidx, ALLOC_WMARK_LOW|ALLOC_CPUSET,
@@ -2468,7 +5637,7 @@ retry_cpuset:
 	if (unlikely(!page))
 		page = __alloc_pages_slowpath(gfp_mask, order,
 				zonelist, high_zoneidx, nodemask,
-				preferred_zone, migratetype);
+				preferred_zone, migratetype, _RET_IP_);
 
 	trace_mm_page_alloc(page, order, gfp_mask, migratetype);
 
@@ -2482,9 +5651,188 @@ out:
 	if (unlikely(!put_mems_allowed(cpuset_mems_cookie) && !page))
 		goto retry_cpuset;
 
-	return page;
+	zonelist_read_unlock(zonelist_idx);
+	return page;
+}
+EXPORT_SYMBOL(__alloc_pages_nodemask);
+
+/*
+ * 分配一个指定颜色的0阶页面。只在快速路径上按颜色挑选：低水印以上从
+ * 着色链表里取，想要的颜色暂时没有时退回相邻的颜色；快速路径失败或者
+ * 没有打开页着色时，退回普通的alloc_pages_node()，不保证颜色。
+ */
+struct page *alloc_page_colour(gfp_t gfp_mask, int nid, unsigned int colour)
+{
+	enum zone_type high_zoneidx;
+	struct zonelist *zonelist;
+	struct zone *preferred_zone;
+	struct page *page = NULL;
+	int alloc_flags, idx;
+
+	if (nid == NUMA_NO_NODE)
+		nid = numa_node_id();
+	if (!page_colour_mask)
+		return alloc_pages_node(nid, gfp_mask, 0);
+
+	gfp_mask &= gfp_allowed_mask;
+	high_zoneidx = gfp_zone(gfp_mask);
+	idx = zonelist_read_lock();
+	zonelist = node_zonelist_live(nid, gfp_mask, idx);
+	first_zones_zonelist(zonelist, high_zoneidx, NULL, &preferred_zone);
+	if (preferred_zone) {
+		alloc_flags = ALLOC_WMARK_LOW | ALLOC_COLOUR |
+			((colour & page_colour_mask) << ALLOC_COLOUR_SHIFT);
+		page = get_page_from_freelist(gfp_mask, NULL, 0, zonelist,
+				high_zoneidx, alloc_flags, preferred_zone,
+				allocflags_to_migratetype(gfp_mask));
+	}
+	zonelist_read_unlock(idx);
+	if (!page)
+		return alloc_pages_node(nid, gfp_mask, 0);
+
+	trace_mm_page_alloc(page, 0, gfp_mask,
+			    allocflags_to_migratetype(gfp_mask));
+	return page;
+}
+EXPORT_SYMBOL(alloc_page_colour);
+
+/*
+ * 异步页分配。
+ *
+ * 带__GFP_WAIT的调用者在慢速路径里会因为回收、wait_iff_congested和
+ * 重试循环而阻塞。可以先做别的事情的调用者（例如控制面的工作项）改用
+ * alloc_pages_async()：快速路径能满足时直接返回页面；否则请求排队，
+ * 唤醒kswapd，等到有页面被释放（kswapd回收的页面也经由释放路径回来）
+ * 时再试，成功后调用req->complete(req, page)。到了req->deadline仍未
+ * 满足的请求以page == NULL完成。回调在进程上下文中调用。
+ * struct page_alloc_request见page_alloc_async.h。
+ */
+
+/* 没有页面释放时，也要按这个间隔检查请求是否超时 */
+#define ASYNC_ALLOC_POLL	(HZ / 10)
+
+static LIST_HEAD(async_alloc_queue);
+static DEFINE_SPINLOCK(async_alloc_lock);
+static DECLARE_DELAYED_WORK(async_alloc_poll_work, async_alloc_process);
+
+/* 只尝试快速路径：低水印以上，不回收、不压缩、不动用保留 */
+static struct page *async_alloc_try(struct page_alloc_request *req,
+				    bool wake_kswapd)
+{
+	gfp_t gfp_mask = (req->gfp_mask & gfp_allowed_mask) & ~__GFP_WAIT;
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	int idx = zonelist_read_lock();
+	struct zonelist *zonelist = node_zonelist_live(req->nid, gfp_mask, idx);
+	struct zone *preferred_zone;
+	struct page *page = NULL;
+
+	first_zones_zonelist(zonelist, high_zoneidx, NULL, &preferred_zone);
+	if (!preferred_zone)
+		goto out;
+
+	page = get_page_from_freelist(gfp_mask, NULL, req->order,
+			zonelist, high_zoneidx, ALLOC_WMARK_LOW,
+			preferred_zone, allocflags_to_migratetype(gfp_mask));
+	if (!page && wake_kswapd && !(gfp_mask & __GFP_NO_KSWAPD))
+		wake_all_kswapd(req->order, zonelist, high_zoneidx,
+				zone_idx(preferred_zone));
+out:
+	zonelist_read_unlock(idx);
+	if (page)
+		trace_mm_page_alloc(page, req->order, gfp_mask,
+				    allocflags_to_migratetype(gfp_mask));
+	return page;
+}
+
+static void async_alloc_process(struct work_struct *work)
+{
+	struct page_alloc_request *req, *next;
+	LIST_HEAD(done);
+
+	/* 之后的释放可以再排一次irq_work */
+	clear_bit(0, &async_alloc_kicked);
+	smp_mb__after_clear_bit();
+
+	spin_lock_irq(&async_alloc_lock);
+	list_for_each_entry_safe(req, next, &async_alloc_queue, list) {
+		req->page = async_alloc_try(req, false);
+		if (!req->page && time_before(jiffies, req->deadline))
+			continue;
+		list_move_tail(&req->list, &done);
+		atomic_dec(&nr_async_alloc_pending);
+	}
+	if (!list_empty(&async_alloc_queue))
+		schedule_delayed_work(&async_alloc_poll_work,
+				      ASYNC_ALLOC_POLL);
+	spin_unlock_irq(&async_alloc_lock);
+
+	list_for_each_entry_safe(req, next, &done, list) {
+		list_del_init(&req->list);
+		req->complete(req, req->page);
+	}
+}
+
+/**
+ * alloc_pages_async - 不阻塞地分配页面，必要时排队等待
+ * @req: 描述分配的请求
+ *
+ * 快速路径能满足时返回页面，不调用回调。否则请求被排队，返回NULL，
+ * 之后通过req->complete()报告结果。
+ */
+struct page *alloc_pages_async(struct page_alloc_request *req)
+{
+	struct page *page;
+	unsigned long flags;
+
+	if (WARN_ON_ONCE(req->order >= MAX_ORDER || !req->complete))
+		return NULL;
+	if (req->nid == NUMA_NO_NODE)
+		req->nid = numa_node_id();
+	else if (WARN_ON_ONCE(req->nid < 0 || req->nid >= nr_node_ids ||
+			      !node_online(req->nid)))
+		req->nid = numa_node_id();
+
+	page = async_alloc_try(req, true);
+	if (page)
+		return page;
+
+	spin_lock_irqsave(&async_alloc_lock, flags);
+	list_add_tail(&req->list, &async_alloc_queue);
+	atomic_inc(&nr_async_alloc_pending);
+	schedule_delayed_work(&async_alloc_poll_work, ASYNC_ALLOC_POLL);
+	spin_unlock_irqrestore(&async_alloc_lock, flags);
+
+	return NULL;
 }
-EXPORT_SYMBOL(__alloc_pages_nodemask);
+EXPORT_SYMBOL(alloc_pages_async);
+
+/**
+ * cancel_alloc_pages_async - 取消一个排队中的异步分配
+ * @req: alloc_pages_async()排队的请求
+ *
+ * 如果请求在完成之前被取下，返回true，回调不会被调用；返回false
+ * 说明回调已经或正在被调用。
+ */
+bool cancel_alloc_pages_async(struct page_alloc_request *req)
+{
+	unsigned long flags;
+	bool queued = false;
+	struct page_alloc_request *iter;
+
+	spin_lock_irqsave(&async_alloc_lock, flags);
+	list_for_each_entry(iter, &async_alloc_queue, list) {
+		if (iter == req) {
+			list_del_init(&req->list);
+			atomic_dec(&nr_async_alloc_pending);
+			queued = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&async_alloc_lock, flags);
+
+	return queued;
+}
+EXPORT_SYMBOL(cancel_alloc_pages_async);
 
 /*
  * 常见的辅助功能。
@@ -2620,8 +5968,10 @@ static unsigned int nr_free_zone_pages(int offset)
 
 	/* 只需挑选一个节点，因为回退列表是循环的 */
 	unsigned int sum = 0;
+	int idx = zonelist_read_lock();
 
-	struct zonelist *zonelist = node_zonelist(numa_node_id(), GFP_KERNEL);
+	struct zonelist *zonelist = node_zonelist_live(numa_node_id(),
+						       GFP_KERNEL, idx);
 
 	for_each_zone_zonelist(zone, z, zonelist, offset) {
 		unsigned long size = zone->present_pages;
@@ -2629,6 +5979,7 @@ static unsigned int nr_free_zone_pages(int offset)
 		if (size > high)
 			sum += size - high;
 	}
+	zonelist_read_unlock(idx);
 
 	return sum;
 }
@@ -2993,6 +6344,187 @@ out:
 	return ret;
 }
 
+/*
+ * 实测的跨节点访存延迟。node_distance()来自固件表（SLIT），常常只是
+ * 粗略的估计。numa_latency_probe=1时，启动后期在每个有CPU的节点上
+ * 对每个有内存的节点做指针追逐，测出的延迟换算成node_distance的
+ * 单位（本地为LOCAL_DISTANCE）存入node_latency，然后重建分区列表。
+ * 没有测到的节点对仍然使用node_distance()。
+ *
+ * 探测缓冲区由numa_latency_probe_mb（默认64MB）决定，必须远大于末级
+ * 缓存，否则测到的是缓存命中或缓存间传输。每个节点对先完整追逐一遍
+ * 预热，把建链时留在缓存里的行挤出去，再测NODE_LATENCY_PASSES遍取
+ * 最小值。每个节点对的耗时约为(1 + NODE_LATENCY_PASSES)遍追逐。
+ */
+static int numa_latency_probe __initdata;
+static unsigned long numa_latency_probe_mb __initdata = 64;
+
+static int __init setup_numa_latency_probe(char *str)
+{
+	numa_latency_probe = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("numa_latency_probe=", setup_numa_latency_probe);
+
+static int __init setup_numa_latency_probe_mb(char *str)
+{
+	numa_latency_probe_mb = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("numa_latency_probe_mb=", setup_numa_latency_probe_mb);
+
+/*
+ * nr_node_ids * nr_node_ids的矩阵，探测时才分配；0表示没有测量，
+ * 否则为每次访存的纳秒数
+ */
+static unsigned int *node_latency __read_mostly;
+
+static inline unsigned int *node_latency_at(int from, int to)
+{
+	return &node_latency[from * nr_node_ids + to];
+}
+
+/* 以node_distance()的单位返回from到to的访存代价 */
+static int node_locality(int from, int to)
+{
+	if (!node_latency)
+		return node_distance(from, to);
+	return pa_latency_locality(*node_latency_at(from, from),
+				   *node_latency_at(from, to),
+				   node_distance(from, to));
+}
+
+#define NODE_LATENCY_ORDER	(MAX_ORDER - 1)
+#define NODE_LATENCY_PASSES	2
+
+/* 缓冲区由若干个不连续的MAX_ORDER块组成，块数是2的幂 */
+struct node_latency_probe {
+	struct page **blocks;
+	unsigned int nr_blocks;
+	unsigned long nr_lines;
+	u64 ns;
+};
+
+static inline void **node_latency_line(struct node_latency_probe *probe,
+				       unsigned long idx)
+{
+	unsigned long per_block = (PAGE_SIZE << NODE_LATENCY_ORDER) /
+				  L1_CACHE_BYTES;
+
+	return page_address(probe->blocks[idx / per_block]) +
+		(idx % per_block) * L1_CACHE_BYTES;
+}
+
+/*
+ * 把所有缓存行串成一个环。行数是2的幂，乘以奇数是一个置换，相邻的
+ * 两步落在整个缓冲区里相距很远的位置，挫败硬件预取。
+ */
+static void __init node_latency_build_chain(struct node_latency_probe *probe)
+{
+	unsigned long i, cur, next, mask = probe->nr_lines - 1;
+
+	for (i = 0; i < probe->nr_lines; i++) {
+		cur = (i * 2654435761UL) & mask;
+		next = ((i + 1) * 2654435761UL) & mask;
+		*node_latency_line(probe, cur) = node_latency_line(probe, next);
+	}
+}
+
+static long __init node_latency_chase(void *arg)
+{
+	struct node_latency_probe *probe = arg;
+	void **pos = node_latency_line(probe, 0);
+	unsigned long i;
+	int pass;
+	u64 start, ns;
+
+	/* 预热：完整的一遍，之后缓存里只剩环尾部的行 */
+	for (i = 0; i < probe->nr_lines; i++)
+		pos = *pos;
+
+	probe->ns = ~0ULL;
+	for (pass = 0; pass < NODE_LATENCY_PASSES; pass++) {
+		start = local_clock();
+		for (i = 0; i < probe->nr_lines; i++)
+			pos = *pos;
+		ns = local_clock() - start;
+		if (ns < probe->ns)
+			probe->ns = ns;
+		cond_resched();
+	}
+
+	/* 让编译器保留追逐的结果 */
+	return pos == NULL;
+}
+
+static int __init numa_latency_probe_init(void)
+{
+	struct node_latency_probe probe;
+	unsigned long block_size = PAGE_SIZE << NODE_LATENCY_ORDER;
+	int from, to, cpu;
+	unsigned int i;
+
+	if (!numa_latency_probe || nr_online_nodes <= 1)
+		return 0;
+
+	probe.nr_blocks = roundup_pow_of_two(max_t(unsigned long, 1,
+				(numa_latency_probe_mb << 20) / block_size));
+	probe.nr_lines = probe.nr_blocks * (block_size / L1_CACHE_BYTES);
+	probe.blocks = kcalloc(probe.nr_blocks, sizeof(struct page *),
+			       GFP_KERNEL);
+	node_latency = kcalloc(nr_node_ids * nr_node_ids,
+			       sizeof(unsigned int), GFP_KERNEL);
+	if (!probe.blocks || !node_latency) {
+		kfree(probe.blocks);
+		kfree(node_latency);
+		node_latency = NULL;
+		return -ENOMEM;
+	}
+
+	for_each_node_state(to, N_HIGH_MEMORY) {
+		for (i = 0; i < probe.nr_blocks; i++) {
+			probe.blocks[i] = alloc_pages_exact_node(to,
+					GFP_KERNEL | __GFP_THISNODE |
+					__GFP_NOWARN, NODE_LATENCY_ORDER);
+			if (!probe.blocks[i])
+				break;
+		}
+		/* 拿不到足够大的缓冲区就不测，免得测成缓存延迟 */
+		if (i < probe.nr_blocks) {
+			printk(KERN_INFO "node %d: no %luMB for latency probe\n",
+			       to, numa_latency_probe_mb);
+			goto out_free;
+		}
+		node_latency_build_chain(&probe);
+
+		for_each_node_state(from, N_CPU) {
+			cpu = cpumask_any_and(cpumask_of_node(from),
+					      cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				continue;
+			work_on_cpu(cpu, node_latency_chase, &probe);
+			*node_latency_at(from, to) = max_t(u64, 1,
+					div64_u64(probe.ns, probe.nr_lines));
+		}
+out_free:
+		while (i--)
+			__free_pages(probe.blocks[i], NODE_LATENCY_ORDER);
+	}
+	kfree(probe.blocks);
+
+	for_each_node_state(from, N_CPU) {
+		printk(KERN_INFO "node %d latency (ns):", from);
+		for_each_node_state(to, N_HIGH_MEMORY)
+			printk(KERN_CONT " %u", *node_latency_at(from, to));
+		printk(KERN_CONT "\n");
+	}
+
+	mutex_lock(&zonelists_mutex);
+	build_all_zonelists(NULL);
+	mutex_unlock(&zonelists_mutex);
+	return 0;
+}
+late_initcall(numa_latency_probe_init);
 
 #define MAX_NODE_LOAD (nr_online_nodes)
 static int node_load[MAX_NUMNODES];
@@ -3016,7 +6548,6 @@ static int find_next_best_node(int node, nodemask_t *used_node_mask)
 	int n, val;
 	int min_val = INT_MAX;
 	int best_node = -1;
-	const struct cpumask *tmp = cpumask_of_node(0);
 
 	/* 如果我们还没有使用本地节点，则使用本地节点 */
 	if (!node_isset(node, *used_node_mask)) {
@@ -3030,20 +6561,13 @@ static int find_next_best_node(int node, nodemask_t *used_node_mask)
 		if (node_isset(n, *used_node_mask))
 			continue;
 
-		/* 使用距离数组来寻找距离 */
-		val = node_distance(node, n);
-
-		/* 对我们下面的节点进行惩罚（"倾向于下一个节点"） */
-		val += (n < node);
-
-		/* 给予无头和未使用的节点优先权 */
-		tmp = cpumask_of_node(n);
-		if (!cpumask_empty(tmp))
-			val += PENALTY_FOR_NODE_WITH_CPUS;
-
-		/* 稍微偏向于负载较少的节点 */
-		val *= (MAX_NODE_LOAD*MAX_NUMNODES);
-		val += node_load[n];
+		/*
+		 * 使用距离数组（或者实测的延迟）来寻找距离，惩罚我们下面的
+		 * 节点，给予无头的节点优先权，并稍微偏向于负载较少的节点
+		 */
+		val = pa_node_rank(node_locality(node, n), node, n,
+				   !cpumask_empty(cpumask_of_node(n)),
+				   MAX_NODE_LOAD * MAX_NUMNODES, node_load[n]);
 
 		if (val < min_val) {
 			min_val = val;
@@ -3063,12 +6587,12 @@ static int find_next_best_node(int node, nodemask_t *used_node_mask)
  * 这样做的结果是最大限度的定位--正常区域会溢出到本地的
  * DMA区，如果有的话--但有可能耗尽DMA区。
  */
-static void build_zonelists_in_node_order(pg_data_t *pgdat, int node)
+static void build_zonelists_in_node_order(struct zonelist *zonelists, int node)
 {
 	int j;
 	struct zonelist *zonelist;
 
-	zonelist = &pgdat->node_zonelists[0];
+	zonelist = &zonelists[0];
 	for (j = 0; zonelist->_zonerefs[j].zone != NULL; j++)
 		;
 	j = build_zonelists_node(NODE_DATA(node), zonelist, j,
@@ -3080,12 +6604,13 @@ static void build_zonelists_in_node_order(pg_data_t *pgdat, int node)
 /*
  *建立gfp_thisnode分区列表
  */
-static void build_thisnode_zonelists(pg_data_t *pgdat)
+static void build_thisnode_zonelists(pg_data_t *pgdat,
+				     struct zonelist *zonelists)
 {
 	int j;
 	struct zonelist *zonelist;
 
-	zonelist = &pgdat->node_zonelists[1];
+	zonelist = &zonelists[1];
 	j = build_zonelists_node(pgdat, zonelist, 0, MAX_NR_ZONES - 1);
 	zonelist->_zonerefs[j].zone = NULL;
 	zonelist->_zonerefs[j].zone_idx = 0;
@@ -3099,14 +6624,15 @@ static void build_thisnode_zonelists(pg_data_t *pgdat)
  */
 static int node_order[MAX_NUMNODES];
 
-static void build_zonelists_in_zone_order(pg_data_t *pgdat, int nr_nodes)
+static void build_zonelists_in_zone_order(struct zonelist *zonelists,
+					  int nr_nodes)
 {
 	int pos, j, node;
 	int zone_type;		/* 需要签名 */
 	struct zone *z;
 	struct zonelist *zonelist;
 
-	zonelist = &pgdat->node_zonelists[0];
+	zonelist = &zonelists[0];
 	pos = 0;
 	for (zone_type = MAX_NR_ZONES - 1; zone_type >= 0; zone_type--) {
 		for (j = 0; j < nr_nodes; j++) {
@@ -3194,7 +6720,8 @@ static void set_zonelist_order(void)
 		current_zonelist_order = user_zonelist_order;
 }
 
-static void build_zonelists(pg_data_t *pgdat)
+/* 为pgdat建立分区列表，写入zonelists[MAX_ZONELISTS] */
+static void build_zonelists(pg_data_t *pgdat, struct zonelist *zonelists)
 {
 	int j, node, load;
 	enum zone_type i;
@@ -3205,7 +6732,7 @@ static void build_zonelists(pg_data_t *pgdat)
 
 	/*初始化分区列表 */
 	for (i = 0; i < MAX_ZONELISTS; i++) {
-		zonelist = pgdat->node_zonelists + i;
+		zonelist = zonelists + i;
 		zonelist->_zonerefs[0].zone = NULL;
 		zonelist->_zonerefs[0].zone_idx = 0;
 	}
@@ -3240,27 +6767,27 @@ static void build_zonelists(pg_data_t *pgdat)
 		prev_node = node;
 		load--;
 		if (order == ZONELIST_ORDER_NODE)
-			build_zonelists_in_node_order(pgdat, node);
+			build_zonelists_in_node_order(zonelists, node);
 		else
 			node_order[j++] = node;	/* 记住顺序 */
 	}
 
 	if (order == ZONELIST_ORDER_ZONE) {
 		/* 计算节点顺序 -- 即DMA最后一个! */
-		build_zonelists_in_zone_order(pgdat, j);
+		build_zonelists_in_zone_order(zonelists, j);
 	}
 
-	build_thisnode_zonelists(pgdat);
+	build_thisnode_zonelists(pgdat, zonelists);
 }
 
 /* 构建分区列表性能缓存--进一步参见mmzone.h */
-static void build_zonelist_cache(pg_data_t *pgdat)
+static void build_zonelist_cache(struct zonelist *zonelists)
 {
 	struct zonelist *zonelist;
 	struct zonelist_cache *zlc;
 	struct zoneref *z;
 
-	zonelist = &pgdat->node_zonelists[0];
+	zonelist = &zonelists[0];
 	zonelist->zlcache_ptr = zlc = &zonelist->zlcache;
 	bitmap_zero(zlc->fullzones, MAX_ZONES_PER_ZONELIST);
 	for (z = zonelist->_zonerefs; z->zone; z++)
@@ -3277,11 +6804,13 @@ static void build_zonelist_cache(pg_data_t *pgdat)
 int local_memory_node(int node)
 {
 	struct zone *zone;
+	int idx = zonelist_read_lock();
 
-	(void)first_zones_zonelist(node_zonelist(node, GFP_KERNEL),
+	(void)first_zones_zonelist(node_zonelist_live(node, GFP_KERNEL, idx),
 				   gfp_zone(GFP_KERNEL),
 				   NULL,
 				   &zone);
+	zonelist_read_unlock(idx);
 	return zone->node;
 }
 #endif
@@ -3293,7 +6822,7 @@ static void set_zonelist_order(void)
 	current_zonelist_order = ZONELIST_ORDER_ZONE;
 }
 
-static void build_zonelists(pg_data_t *pgdat)
+static void build_zonelists(pg_data_t *pgdat, struct zonelist *zonelists)
 {
 	int node, local_node;
 	enum zone_type j;
@@ -3301,7 +6830,7 @@ static void build_zonelists(pg_data_t *pgdat)
 
 	local_node = pgdat->node_id;
 
-	zonelist = &pgdat->node_zonelists[0];
+	zonelist = &zonelists[0];
 	j = build_zonelists_node(pgdat, zonelist, 0, MAX_NR_ZONES - 1);
 
 	/*
@@ -3330,9 +6859,9 @@ static void build_zonelists(pg_data_t *pgdat)
 }
 
 /* 非NUMA变体的zonelist性能缓存--只是NULL zlcache_ptr */
-static void build_zonelist_cache(pg_data_t *pgdat)
+static void build_zonelist_cache(struct zonelist *zonelists)
 {
-	pgdat->node_zonelists[0].zlcache_ptr = NULL;
+	zonelists[0].zlcache_ptr = NULL;
 }
 
 #endif	/* CONFIG_NUMA */
@@ -3362,7 +6891,128 @@ static void setup_zone_pageset(struct zone *zone);
  */
 DEFINE_MUTEX(zonelists_mutex);
 
-/*返回值 int ....just for stop_machine() */
+/* 只比较到结束标记为止，条目数远小于MAX_ZONES_PER_ZONELIST */
+static bool zonelists_equal(struct zonelist *a, struct zonelist *b)
+{
+	int i, n;
+
+	for (i = 0; i < MAX_ZONELISTS; i++) {
+		for (n = 0; a[i]._zonerefs[n].zone; n++)
+			;
+		if (memcmp(a[i]._zonerefs, b[i]._zonerefs,
+			   (n + 1) * sizeof(struct zoneref)))
+			return false;
+	}
+	return true;
+}
+
+/* 启动之后的分区列表重建：发布临界区和等待宽限期的耗时 */
+static unsigned long zonelist_rebuilds;
+static unsigned long zonelist_rebuild_failures;
+static unsigned long zonelist_nodes_swapped;
+static unsigned long zonelist_nodes_unchanged;
+static u64 zonelist_swap_last_ns;
+static u64 zonelist_swap_max_ns;
+static u64 zonelist_grace_last_ns;
+
+/* 每个节点一份MAX_ZONELISTS项的新列表，由zonelists_mutex保护 */
+static struct zonelist *zonelist_staging[MAX_NUMNODES];
+static bool zonelist_srcu_ready;
+
+/*
+ * 发布zonelist_staging[]中建好的列表。和当前列表相同的节点不换；其余
+ * 节点只是一次指针赋值，写者不关中断，读者既不等待也不重试。被换下
+ * 的缓冲区等到所有读临界区结束后再释放，pgdat里启动时的列表不释放。
+ */
+static void publish_zonelists(void)
+{
+	struct zonelist **staging = zonelist_staging;
+	u64 start, elapsed;
+	int nid, swapped = 0;
+
+	for_each_online_node(nid) {
+		struct zonelist *cur;
+
+		cur = rcu_dereference_protected(node_zonelists_live[nid],
+				lockdep_is_held(&zonelists_mutex));
+		if (!cur)
+			cur = NODE_DATA(nid)->node_zonelists;
+		if (zonelists_equal(cur, staging[nid])) {
+			vfree(staging[nid]);
+			staging[nid] = NULL;
+			zonelist_nodes_unchanged++;
+		}
+	}
+
+	if (!zonelists_published) {
+		/* 读者看到zonelists_published时zonelist_srcu已经初始化 */
+		smp_wmb();
+		zonelists_published = true;
+	}
+
+	start = local_clock();
+	for_each_online_node(nid) {
+		struct zonelist *old;
+
+		if (!staging[nid])
+			continue;
+		old = rcu_dereference_protected(node_zonelists_live[nid],
+				lockdep_is_held(&zonelists_mutex));
+		rcu_assign_pointer(node_zonelists_live[nid], staging[nid]);
+		staging[nid] = old;
+		swapped++;
+	}
+	elapsed = local_clock() - start;
+
+	zonelist_nodes_swapped += swapped;
+	zonelist_swap_last_ns = elapsed;
+	if (elapsed > zonelist_swap_max_ns)
+		zonelist_swap_max_ns = elapsed;
+	if (!swapped)
+		return;
+
+	start = local_clock();
+	synchronize_srcu(&zonelist_srcu);
+	zonelist_grace_last_ns = local_clock() - start;
+	for_each_online_node(nid) {
+		vfree(staging[nid]);
+		staging[nid] = NULL;
+	}
+}
+
+/*
+ * 给每个在线节点分配一份新列表。任何一个节点分配失败都放弃这次重建，
+ * 所有节点继续用原来的列表：node_load[]让各节点的顺序互相影响，不能
+ * 只换一部分。
+ */
+static int alloc_zonelist_staging(void)
+{
+	int nid;
+
+	if (!zonelist_srcu_ready) {
+		if (init_srcu_struct(&zonelist_srcu))
+			return -ENOMEM;
+		zonelist_srcu_ready = true;
+	}
+	for_each_online_node(nid) {
+		zonelist_staging[nid] = vmalloc(MAX_ZONELISTS *
+						sizeof(struct zonelist));
+		if (!zonelist_staging[nid])
+			goto fail;
+	}
+	return 0;
+fail:
+	for_each_online_node(nid) {
+		vfree(zonelist_staging[nid]);
+		zonelist_staging[nid] = NULL;
+	}
+	return -ENOMEM;
+}
+
+/*
+ * data不为NULL时把新列表建在zonelist_staging[]里，再由
+ * publish_zonelists()发布；启动时直接建在pgdat中。
+ */
 static __init_refok int __build_all_zonelists(void *data)
 {
 	int nid;
@@ -3373,10 +7023,15 @@ static __init_refok int __build_all_zonelists(void *data)
 #endif
 	for_each_online_node(nid) {
 		pg_data_t *pgdat = NODE_DATA(nid);
+		struct zonelist *zonelists = pgdat->node_zonelists;
 
-		build_zonelists(pgdat);
-		build_zonelist_cache(pgdat);
+		if (data)
+			zonelists = zonelist_staging[nid];
+		build_zonelists(pgdat, zonelists);
+		build_zonelist_cache(zonelists);
 	}
+	if (data)
+		publish_zonelists();
 
 	/*
 	 * 初始化将被用于引导处理器的boot_pagesets。
@@ -3392,7 +7047,12 @@ static __init_refok int __build_all_zonelists(void *data)
 	 *（一个鸡生蛋的困境）。
 	 */
 	for_each_possible_cpu(cpu) {
-		setup_pageset(&per_cpu(boot_pageset, cpu), 0);
+		/*
+		 * 启动之后重建时其他CPU仍在运行，还没有自己页集的区
+		 * 可能正在使用boot_pageset，不能把它重置。
+		 */
+		if (system_state == SYSTEM_BOOTING)
+			setup_pageset(&per_cpu(boot_pageset, cpu), 0);
 
 #ifdef CONFIG_HAVE_MEMORYLESS_NODES
 		/*
@@ -3411,6 +7071,41 @@ static __init_refok int __build_all_zonelists(void *data)
 	return 0;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int zonelist_rebuild_show(struct seq_file *m, void *arg)
+{
+	unsigned long remaps = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		remaps += per_cpu(zonelist_remaps, cpu);
+
+	mutex_lock(&zonelists_mutex);
+	seq_printf(m, "rebuilds        %lu\n", zonelist_rebuilds);
+	seq_printf(m, "failures        %lu\n", zonelist_rebuild_failures);
+	seq_printf(m, "nodes_swapped   %lu\n", zonelist_nodes_swapped);
+	seq_printf(m, "nodes_unchanged %lu\n", zonelist_nodes_unchanged);
+	seq_printf(m, "swap_last_ns    %llu\n", zonelist_swap_last_ns);
+	seq_printf(m, "swap_max_ns     %llu\n", zonelist_swap_max_ns);
+	seq_printf(m, "grace_last_ns   %llu\n", zonelist_grace_last_ns);
+	seq_printf(m, "reader_remaps   %lu\n", remaps);
+	mutex_unlock(&zonelists_mutex);
+	return 0;
+}
+
+static int zonelist_rebuild_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zonelist_rebuild_show, NULL);
+}
+
+static const struct file_operations zonelist_rebuild_fops = {
+	.open		= zonelist_rebuild_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  *调用时始终保持zonelists_mutex。
  * Unless system_state == SYSTEM_BOOTING.
@@ -3424,13 +7119,24 @@ void __ref build_all_zonelists(void *data)
 		mminit_verify_zonelist();
 		cpuset_init_current_mems_allowed();
 	} else {
-		/* 我们必须停止所有的cpus，以保证没有用户使用分区列表
-		   的用户 */
+		/*
+		 * 不再用stop_machine冻结所有CPU。新的分区列表建在单独的
+		 * 缓冲区里，分配路径在此期间照常运行，建好后按节点换指针，
+		 * 见publish_zonelists()。缓冲区分配失败时保留原来的列表，
+		 * 不在原地重建。
+		 */
 #ifdef CONFIG_MEMORY_HOTPLUG
 		if (data)
 			setup_zone_pageset((struct zone *)data);
 #endif
-		stop_machine(__build_all_zonelists, NULL, NULL);
+		if (!alloc_zonelist_staging()) {
+			__build_all_zonelists(zonelist_staging);
+			zonelist_rebuilds++;
+		} else {
+			zonelist_rebuild_failures++;
+			printk(KERN_WARNING "build_all_zonelists: out of memory, "
+			       "keeping the old zonelists\n");
+		}
 		/* cpuset刷新程序应该在这里 */
 	}
 	vm_total_pages = nr_free_pagecache_pages();
@@ -3474,8 +7180,30 @@ void __ref build_all_zonelists(void *data)
  */
 #define PAGES_PER_WAITQUEUE	256
 
-#ifndef CONFIG_MEMORY_HOTPLUG
-static inline unsigned long wait_table_hash_nr_entries(unsigned long pages)
+/*
+ * 等待表大小的上限。大区上lock_page和回写等待很多时，4096个桶碰撞严重，
+ * 可以用wait_table_max=N（2的幂）提高上限。
+ */
+#define WAIT_TABLE_DEFAULT_MAX	4096UL
+#define WAIT_TABLE_LIMIT	(1UL << 20)
+
+static unsigned long wait_table_max __meminitdata = WAIT_TABLE_DEFAULT_MAX;
+
+static int __init setup_wait_table_max(char *str)
+{
+	unsigned long max = simple_strtoul(str, &str, 0);
+
+	if (max < 4 || !is_power_of_2(max)) {
+		printk(KERN_WARNING "wait_table_max=%lu ignored, "
+				    "must be a power of 2 >= 4\n", max);
+		return 1;
+	}
+	wait_table_max = min(max, WAIT_TABLE_LIMIT);
+	return 1;
+}
+__setup("wait_table_max=", setup_wait_table_max);
+
+static inline unsigned long wait_table_size_for(unsigned long pages)
 {
 	unsigned long size = 1;
 
@@ -3484,12 +7212,20 @@ static inline unsigned long wait_table_hash_nr_entries(unsigned long pages)
 	while (size < pages)
 		size <<= 1;
 
+	return size;
+}
+
+#ifndef CONFIG_MEMORY_HOTPLUG
+static inline unsigned long wait_table_hash_nr_entries(unsigned long pages)
+{
+	unsigned long size = wait_table_size_for(pages);
+
 	/*
 	 * 一旦我们有几十个甚至几百个线程在睡觉
 	 *在IO上，我们就会遇到比等待队列碰撞更大的问题。
 	 * 把等待表的大小限制在一个合理的范围内。
 	 */
-	size = min(size, 4096UL);
+	size = min(size, wait_table_max);
 
 	return max(size, 4UL);
 }
@@ -3510,10 +7246,16 @@ static inline unsigned long wait_table_hash_nr_entries(unsigned long pages)
  * i386, x86-64, powerpc(4K页面大小) : = ( 2G + 1M)byte.
  *ia64(16K页面大小) : = ( 8G + 4M)字节。
  * powerpc(64K页面大小) : = ( 32G + 16M)字节。
+ *
+ * 提高了wait_table_max时，启动时已经很大的区按页数取更大的表，
+ * 但不超过上限。
  */
 static inline unsigned long wait_table_hash_nr_entries(unsigned long pages)
 {
-	return 4096UL;
+	unsigned long size = wait_table_size_for(pages);
+
+	size = max(size, WAIT_TABLE_DEFAULT_MAX);
+	return min(size, wait_table_max);
 }
 #endif
 
@@ -3544,14 +7286,106 @@ static int pageblock_is_reserved(unsigned long start_pfn, unsigned long end_pfn)
 }
 
 /*
- * 将一些页锁标记为MIGRATE_RESERVE。这个数字
- * 保留的块数是基于min_wmark_pages(zone)。内的内存
- * 保留的内存将倾向于存储连续的空闲页。设置min_free_kbytes
- * 会导致一个更大的保留区，它将被释放为连续的
- * 块被释放。
+ * 按需求历史估算还需要多少额外的保留块：把各阶的需求次数折算成
+ * 页数，向上取整到页块。需求在每次调整后减半，只要还有需求，调整
+ * 就每隔MIGRATE_RESERVE_DECAY重做一次，短时的突发不会让保留区一直
+ * 保持很大。
+ */
+#define MIGRATE_RESERVE_DECAY	(10 * HZ)
+
+static int migrate_reserve_demand_blocks(struct zone *zone)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	unsigned long pages = 0;
+	int order;
+
+	for (order = 1; order < MAX_ORDER; order++)
+		pages += atomic_long_read(&ext->reserve_demand[order]) << order;
+
+	return DIV_ROUND_UP(pages, pageblock_nr_pages);
+}
+
+/* 该区应有的保留块数 */
+static int migrate_reserve_blocks(struct zone *zone)
+{
+	int reserve;
+
+	reserve = roundup(min_wmark_pages(zone), pageblock_nr_pages) >>
+							pageblock_order;
+
+	/*
+	 * 储备块通常是为了帮助高阶原子性的
+	 * 的分配，这些分配是短暂的。一个min_free_kbytes的值
+	 * 会导致原子分配的储备块超过2个
+	 * 被认为是为了帮助反碎片化而设置的。
+	 * 未来在运行时分配的hugepages。
+	 * 超出这2块的部分只按实际的高阶原子分配需求给出，
+	 * 并且不超过区大小的1/16。
+	 */
+	reserve = min(2, reserve);
+	reserve += min_t(unsigned long, migrate_reserve_demand_blocks(zone),
+			 (zone->present_pages >> pageblock_order) / 16);
+
+	return min(reserve, MAX_MIGRATE_RESERVE_BLOCKS);
+}
+
+/*
+ * 记录一次高阶原子分配进入慢速路径。如果按新的需求保留区需要变大，
+ * 交给工作队列去调整；这里可能处于中断上下文，不能扫描区。
+ */
+static void migrate_reserve_resize(struct work_struct *work);
+static DECLARE_DELAYED_WORK(migrate_reserve_work, migrate_reserve_resize);
+
+static void note_atomic_reserve_demand(struct zone *zone, unsigned int order)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+
+	atomic_long_inc(&ext->reserve_demand[order]);
+	if (migrate_reserve_blocks(zone) > ext->nr_reserve)
+		schedule_delayed_work(&migrate_reserve_work, HZ);
+}
+
+/*
+ * 增量调整保留块。丢掉已经不再是MIGRATE_RESERVE的记录（比如被隔离过），
+ * 多出来的块还给MIGRATE_MOVABLE。只有需要新增保留块时才返回false，
+ * 由调用者做一次完整扫描。
+ */
+static bool migrate_reserve_adjust(struct zone *zone, int reserve)
+{
+	struct zone_alloc_ext *ext = zone_ext(zone);
+	struct page *page;
+	int i, nr = 0;
+
+	for (i = 0; i < ext->nr_reserve; i++) {
+		page = pfn_to_page(ext->reserve_pfn[i]);
+		if (get_pageblock_migratetype(page) == MIGRATE_RESERVE)
+			ext->reserve_pfn[nr++] = ext->reserve_pfn[i];
+	}
+	ext->nr_reserve = nr;
+
+	if (nr < reserve)
+		return false;
+
+	while (ext->nr_reserve > reserve) {
+		page = pfn_to_page(ext->reserve_pfn[--ext->nr_reserve]);
+		set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+		move_freepages_block(zone, page, MIGRATE_MOVABLE);
+	}
+	return true;
+}
+
+/*
+ * 将一些页块标记为MIGRATE_RESERVE。保留块的数量一部分基于
+ * min_wmark_pages(zone)，一部分基于该区高阶原子分配的需求历史。
+ * 保留区内的内存倾向于保持为连续的空闲页。
+ *
+ * 第一次调用时扫描整个区；之后只要不需要新增保留块，就只处理
+ * 已记录的保留块，修改min_free_kbytes不再引起O(spanned_pages)的扫描。
+ * 调用时持有zone->lock。
  */
 static void setup_zone_migrate_reserve(struct zone *zone)
 {
+	struct zone_alloc_ext *ext = zone_ext(zone);
 	unsigned long start_pfn, pfn, end_pfn, block_end_pfn;
 	struct page *page;
 	unsigned long block_migratetype;
@@ -3566,18 +7400,12 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 	start_pfn = zone->zone_start_pfn;
 	end_pfn = start_pfn + zone->spanned_pages;
 	start_pfn = roundup(start_pfn, pageblock_nr_pages);
-	reserve = roundup(min_wmark_pages(zone), pageblock_nr_pages) >>
-							pageblock_order;
+	reserve = migrate_reserve_blocks(zone);
 
-	/*
-	 * 储备块通常是为了帮助高阶原子性的
-	 * 的分配，这些分配是短暂的。一个min_free_kbytes的值
-	 * 会导致原子分配的储备块超过2个
-	 * 被认为是为了帮助反碎片化而设置的。
-	 * 未来在运行时分配的hugepages。
-	 */
-	reserve = min(2, reserve);
+	if (ext->reserve_scanned && migrate_reserve_adjust(zone, reserve))
+		return;
 
+	ext->nr_reserve = 0;
 	for (pfn = start_pfn; pfn < end_pfn; pfn += pageblock_nr_pages) {
 		if (!pfn_valid(pfn))
 			continue;
@@ -3600,6 +7428,7 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 
 			/* 如果这个区块被保留了，请将其记入 */
 			if (block_migratetype == MIGRATE_RESERVE) {
+				ext->reserve_pfn[ext->nr_reserve++] = pfn;
 				reserve--;
 				continue;
 			}
@@ -3610,6 +7439,7 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 							MIGRATE_RESERVE);
 				move_freepages_block(zone, page,
 							MIGRATE_RESERVE);
+				ext->reserve_pfn[ext->nr_reserve++] = pfn;
 				reserve--;
 				continue;
 			}
@@ -3624,8 +7454,84 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 			move_freepages_block(zone, page, MIGRATE_MOVABLE);
 		}
 	}
+	ext->reserve_scanned = 1;
+}
+
+/* 把需求减半；和note_atomic_reserve_demand()并发时不丢失增量 */
+static long reserve_demand_decay(atomic_long_t *demand)
+{
+	long old, new;
+
+	do {
+		old = atomic_long_read(demand);
+		new = old >> 1;
+	} while (old && atomic_long_cmpxchg(demand, old, new) != old);
+
+	return new;
+}
+
+/*
+ * 按需求调整所有区的保留块，然后让需求历史衰减一半。还有残余需求
+ * 或保留区比需求大时重新排期，让保留区随衰减逐步缩回去。
+ */
+static void migrate_reserve_resize(struct work_struct *work)
+{
+	struct zone *zone;
+	unsigned long flags;
+	bool rearm = false;
+	int order;
+
+	for_each_populated_zone(zone) {
+		struct zone_alloc_ext *ext = zone_ext(zone);
+
+		spin_lock_irqsave(&zone->lock, flags);
+		setup_zone_migrate_reserve(zone);
+		for (order = 0; order < MAX_ORDER; order++) {
+			if (reserve_demand_decay(&ext->reserve_demand[order]))
+				rearm = true;
+		}
+		if (migrate_reserve_blocks(zone) < ext->nr_reserve)
+			rearm = true;
+		spin_unlock_irqrestore(&zone->lock, flags);
+	}
+
+	if (rearm)
+		schedule_delayed_work(&migrate_reserve_work,
+				      MIGRATE_RESERVE_DECAY);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int migrate_reserve_show(struct seq_file *m, void *arg)
+{
+	struct zone *zone;
+	int order;
+
+	for_each_populated_zone(zone) {
+		struct zone_alloc_ext *ext = zone_ext(zone);
+
+		seq_printf(m, "Node %d, zone %8s blocks %d demand",
+			   zone_to_nid(zone), zone->name, ext->nr_reserve);
+		for (order = 0; order < MAX_ORDER; order++)
+			seq_printf(m, " %ld",
+				   atomic_long_read(&ext->reserve_demand[order]));
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int migrate_reserve_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, migrate_reserve_show, NULL);
 }
 
+static const struct file_operations migrate_reserve_fops = {
+	.open		= migrate_reserve_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  * 最初，所有的页面都被保留，空闲的页面被释放。
  * 一旦早期的启动过程结束，就由free_all_bootmem()释放。
@@ -3696,6 +7602,7 @@ static void __meminit zone_init_free_lists(struct zone *zone)
 		INIT_LIST_HEAD(&zone->free_area[order].free_list[t]);
 		zone->free_area[order].nr_free = 0;
 	}
+	zone_ext(zone)->free_order_mask = 0;
 }
 
 #ifndef __HAVE_ARCH_MEMMAP_INIT
@@ -3768,6 +7675,13 @@ static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 		INIT_LIST_HEAD(&pcp->lists[migratetype]);
 }
 
+static unsigned long pagelist_batch(unsigned long high)
+{
+	if ((high/4) > (PAGE_SHIFT * 8))
+		return PAGE_SHIFT * 8;
+	return max(1UL, high/4);
+}
+
 /*
  * setup_pagelist_highmark()为热的per_cpu_pagelist设置高水位标记。
  * 的高水位，并将其设置为pageset的高值。
@@ -3780,9 +7694,7 @@ static void setup_pagelist_highmark(struct per_cpu_pageset *p,
 
 	pcp = &p->pcp;
 	pcp->high = high;
-	pcp->batch = max(1UL, high/4);
-	if ((high/4) > (PAGE_SHIFT * 8))
-		pcp->batch = PAGE_SHIFT * 8;
+	pcp->batch = pagelist_batch(high);
 }
 
 static void setup_zone_pageset(struct zone *zone)
@@ -3790,6 +7702,9 @@ static void setup_zone_pageset(struct zone *zone)
 	int cpu;
 
 	zone->pageset = alloc_percpu(struct per_cpu_pageset);
+	setup_zone_high_order_pcp(zone);
+	setup_zone_colour_pcp(zone);
+	setup_zone_pcp_config(zone);
 
 	for_each_possible_cpu(cpu) {
 		struct per_cpu_pageset *pcp = per_cpu_ptr(zone->pageset, cpu);
@@ -3858,30 +7773,199 @@ int zone_wait_table_init(struct zone *zone, unsigned long zone_size_pages)
 	return 0;
 }
 
-static int __zone_pcp_update(void *data)
+#ifdef CONFIG_DEBUG_FS
+/*
+ * 每个区的等待表：桶数、有等待者的桶、等待者总数，以及单个桶里最多的
+ * 等待者数。一个桶里的多个等待者可能在等同一个页面，所以最后一项是
+ * 碰撞的上界。这是一次采样，每个桶在自己的锁下计数。
+ */
+static int wait_tables_show(struct seq_file *m, void *arg)
 {
-	struct zone *zone = data;
-	int cpu;
-	unsigned long batch = zone_batchsize(zone), flags;
+	struct zone *zone;
 
-	for_each_possible_cpu(cpu) {
-		struct per_cpu_pageset *pset;
-		struct per_cpu_pages *pcp;
+	seq_printf(m, "%-4s %-8s %8s %8s %8s %8s\n", "node", "zone",
+		   "buckets", "active", "waiters", "max");
+	for_each_populated_zone(zone) {
+		unsigned long i, active = 0, waiters = 0, deepest = 0;
 
-		pset = per_cpu_ptr(zone->pageset, cpu);
-		pcp = &pset->pcp;
+		for (i = 0; i < zone->wait_table_hash_nr_entries; i++) {
+			wait_queue_head_t *wq = &zone->wait_table[i];
+			struct list_head *pos;
+			unsigned long flags, n = 0;
 
-		local_irq_save(flags);
-		free_pcppages_bulk(zone, pcp->count, pcp);
-		setup_pageset(pset, batch);
-		local_irq_restore(flags);
+			if (!waitqueue_active(wq))
+				continue;
+			spin_lock_irqsave(&wq->lock, flags);
+			list_for_each(pos, &wq->task_list)
+				n++;
+			spin_unlock_irqrestore(&wq->lock, flags);
+
+			if (n)
+				active++;
+			waiters += n;
+			deepest = max(deepest, n);
+		}
+		seq_printf(m, "%-4d %-8s %8lu %8lu %8lu %8lu\n",
+			   zone_to_nid(zone), zone->name,
+			   zone->wait_table_hash_nr_entries, active,
+			   waiters, deepest);
+		cond_resched();
 	}
 	return 0;
 }
 
+static int wait_tables_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wait_tables_show, NULL);
+}
+
+static const struct file_operations wait_tables_fops = {
+	.open		= wait_tables_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * page_alloc/wait_bench：竞争下的唤醒延迟。写入等待者数N后，锁住N个
+ * 私有页面，每个页面起一个内核线程在wait_on_page_locked()里睡眠，走的
+ * 是真实的page_waitqueue()和区的等待表；然后逐个unlock_page()，记录
+ * unlock_page()本身的耗时（要在桶里跳过不相干的等待者）和从解锁到
+ * 等待者醒来的延迟。N越大、桶越少，同一个桶里的等待者越多，两项都
+ * 越大；用wait_table_max=提高上限后重新测量即可比较。
+ */
+#define WAIT_BENCH_MAX		8192
+
+struct wait_bench_waiter {
+	struct page *page;
+	u64 woken;
+	atomic_t *started;
+	struct completion done;
+};
+
+static DEFINE_MUTEX(wait_bench_mutex);
+static unsigned long wait_bench_waiters;
+static u64 wait_bench_unlock_ns, wait_bench_lat_ns, wait_bench_lat_max;
+
+static int wait_bench_thread(void *arg)
+{
+	struct wait_bench_waiter *w = arg;
+
+	atomic_inc(w->started);
+	wait_on_page_locked(w->page);
+	w->woken = local_clock();
+	complete(&w->done);
+	return 0;
+}
+
+static int wait_bench_show(struct seq_file *m, void *arg)
+{
+	mutex_lock(&wait_bench_mutex);
+	seq_printf(m, "waiters %lu\nunlock_ns %llu\nwake_ns %llu\n"
+		   "wake_max_ns %llu\n", wait_bench_waiters,
+		   (unsigned long long)wait_bench_unlock_ns,
+		   (unsigned long long)wait_bench_lat_ns,
+		   (unsigned long long)wait_bench_lat_max);
+	mutex_unlock(&wait_bench_mutex);
+	return 0;
+}
+
+static int wait_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wait_bench_show, NULL);
+}
+
+static ssize_t wait_bench_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct wait_bench_waiter *waiters;
+	u64 unlock_ns = 0, lat_ns = 0, lat_max = 0;
+	atomic_t started = ATOMIC_INIT(0);
+	unsigned long nr, i, running = 0;
+	char buf[32];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (kstrtoul(strstrip(buf), 0, &nr) || !nr || nr > WAIT_BENCH_MAX)
+		return -EINVAL;
+
+	waiters = vzalloc(nr * sizeof(*waiters));
+	if (!waiters)
+		return -ENOMEM;
+
+	mutex_lock(&wait_bench_mutex);
+	for (i = 0; i < nr; i++) {
+		struct wait_bench_waiter *w = &waiters[i];
+		struct task_struct *t;
+
+		w->page = alloc_page(GFP_KERNEL);
+		if (!w->page)
+			break;
+		/* 私有页面，没有别人会锁它 */
+		lock_page(w->page);
+		w->started = &started;
+		init_completion(&w->done);
+		t = kthread_run(wait_bench_thread, w, "wait_bench/%lu", i);
+		if (IS_ERR(t)) {
+			unlock_page(w->page);
+			__free_page(w->page);
+			w->page = NULL;
+			break;
+		}
+		running++;
+	}
+	/* 等所有线程都进入睡眠 */
+	while (atomic_read(&started) < running)
+		msleep(1);
+	msleep(20);
+
+	for (i = 0; i < running; i++) {
+		struct wait_bench_waiter *w = &waiters[i];
+		u64 t0, t1;
+
+		t0 = local_clock();
+		unlock_page(w->page);
+		t1 = local_clock();
+		wait_for_completion(&w->done);
+		unlock_ns += t1 - t0;
+		lat_ns += w->woken - t0;
+		lat_max = max(lat_max, w->woken - t0);
+		__free_page(w->page);
+	}
+
+	if (running) {
+		wait_bench_waiters = running;
+		wait_bench_unlock_ns = div64_u64(unlock_ns, running);
+		wait_bench_lat_ns = div64_u64(lat_ns, running);
+		wait_bench_lat_max = lat_max;
+	}
+	mutex_unlock(&wait_bench_mutex);
+	vfree(waiters);
+
+	return running ? count : -ENOMEM;
+}
+
+static const struct file_operations wait_bench_fops = {
+	.open		= wait_bench_open,
+	.read		= seq_read,
+	.write		= wait_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
+/*
+ * 内存上线后按新的区大小重新计算batch和high。只发布新值，不清空也
+ * 不打断任何CPU，见pcp_config_publish()。
+ */
 void zone_pcp_update(struct zone *zone)
 {
-	stop_machine(__zone_pcp_update, zone, NULL);
+	unsigned long batch = zone_batchsize(zone);
+
+	pcp_config_publish(zone, 6 * batch, max(1UL, batch));
 }
 
 static __meminit void zone_pcp_init(struct zone *zone)
@@ -4883,6 +8967,7 @@ static int page_alloc_cpu_notify(struct notifier_block *self,
 
 	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
 		lru_add_drain_cpu(cpu);
+		deferred_free_flush_cpu(cpu);
 		drain_pages(cpu);
 
 		/*
@@ -5219,19 +9304,16 @@ int percpu_pagelist_fraction_sysctl_handler(ctl_table *table, int write,
 	void __user *buffer, size_t *length, loff_t *ppos)
 {
 	struct zone *zone;
-	unsigned int cpu;
 	int ret;
 
 	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
 	if (!write || (ret < 0))
 		return ret;
 	for_each_populated_zone(zone) {
-		for_each_possible_cpu(cpu) {
-			unsigned long  high;
-			high = zone->present_pages / percpu_pagelist_fraction;
-			setup_pagelist_highmark(
-				per_cpu_ptr(zone->pageset, cpu), high);
-		}
+		unsigned long high;
+
+		high = zone->present_pages / percpu_pagelist_fraction;
+		pcp_config_publish(zone, high, pagelist_batch(high));
 	}
 	return 0;
 }
@@ -5249,6 +9331,128 @@ static int __init set_hashdist(char *str)
 __setup("hashdist=", set_hashdist);
 #endif
 
+/*
+ * hashcontig=1时，非HASH_EARLY的大哈希表先尝试放在物理连续的页面上
+ * （线性映射，TLB友好），失败后才退回到__vmalloc或者缩小表。多节点机器
+ * 上各个表按节点轮流放置，整表交错而不是逐页交错。
+ */
+static int hash_contig __initdata;
+
+static int __init set_hash_contig(char *str)
+{
+	if (!str)
+		return 0;
+	hash_contig = simple_strtoul(str, &str, 0);
+	return 1;
+}
+__setup("hashcontig=", set_hash_contig);
+
+enum hash_backing {
+	HASH_BACKING_BOOTMEM,
+	HASH_BACKING_VMALLOC,
+	HASH_BACKING_PAGES,
+};
+
+static const char * const hash_backing_names[] = {
+	"bootmem",
+	"vmalloc",
+	"pages",
+};
+
+/* 记录alloc_large_system_hash()分配的每个表，供debugfs查看 */
+#define MAX_SYSTEM_HASHES	32
+
+struct system_hash_info {
+	const char *name;
+	void *table;
+	unsigned long entries;
+	unsigned long bucketsize;
+	unsigned long size;
+	enum hash_backing backing;
+	int nid;		/* vmalloc的表为NUMA_NO_NODE */
+};
+
+static struct system_hash_info system_hashes[MAX_SYSTEM_HASHES];
+static int nr_system_hashes;
+
+static void __init system_hash_register(const char *name, void *table,
+			unsigned long entries, unsigned long bucketsize,
+			unsigned long size, enum hash_backing backing)
+{
+	struct system_hash_info *info;
+
+	if (nr_system_hashes >= MAX_SYSTEM_HASHES)
+		return;
+
+	info = &system_hashes[nr_system_hashes++];
+	info->name = name;
+	info->table = table;
+	info->entries = entries;
+	info->bucketsize = bucketsize;
+	info->size = size;
+	info->backing = backing;
+	if (backing == HASH_BACKING_VMALLOC)
+		info->nid = NUMA_NO_NODE;
+	else
+		info->nid = page_to_nid(virt_to_page(table));
+}
+
+static int hash_contig_node __initdata = MAX_NUMNODES;
+
+static void * __init alloc_hash_contig(unsigned long size)
+{
+	int nid;
+	void *table;
+
+	if (get_order(size) >= MAX_ORDER)
+		return NULL;
+
+	nid = next_node(hash_contig_node, node_online_map);
+	if (nid == MAX_NUMNODES)
+		nid = first_node(node_online_map);
+	hash_contig_node = nid;
+
+	table = alloc_pages_exact_nid(nid, size, GFP_ATOMIC | __GFP_NOWARN);
+	if (table)
+		kmemleak_alloc(table, size, 1, GFP_ATOMIC);
+	return table;
+}
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * 分配器不知道桶的布局，无法统计占用率；这里只报告大小、
+ * 条目数和后备存储的类型。
+ */
+static int system_hashes_show(struct seq_file *m, void *arg)
+{
+	int i;
+
+	seq_printf(m, "%-24s %10s %6s %12s %-8s %5s\n", "name", "entries",
+		   "bucket", "bytes", "backing", "node");
+	for (i = 0; i < nr_system_hashes; i++) {
+		struct system_hash_info *info = &system_hashes[i];
+
+		seq_printf(m, "%-24s %10lu %6lu %12lu %-8s %5d\n",
+			   info->name, info->entries, info->bucketsize,
+			   info->size, hash_backing_names[info->backing],
+			   info->nid);
+	}
+	return 0;
+}
+
+static int system_hashes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, system_hashes_show, NULL);
+}
+
+static const struct file_operations system_hashes_fops = {
+	.open		= system_hashes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 /*
  * 从bootmem中分配一个大的系统哈希表
  * - 假设哈希表必须包含一个精确的2次方的
@@ -5267,6 +9471,7 @@ void *__init alloc_large_system_hash(const char *tablename,
 	unsigned long long max = limit;
 	unsigned long log2qty, size;
 	void *table = NULL;
+	enum hash_backing backing = HASH_BACKING_PAGES;
 
 	/* 允许内核cmdline有发言权 */
 	if (!numentries) {
@@ -5309,11 +9514,20 @@ void *__init alloc_large_system_hash(const char *tablename,
 
 	do {
 		size = bucketsize << log2qty;
-		if (flags & HASH_EARLY)
+		if (flags & HASH_EARLY) {
 			table = alloc_bootmem_nopanic(size);
-		else if (hashdist)
+			backing = HASH_BACKING_BOOTMEM;
+			continue;
+		}
+
+		if (hash_contig) {
+			table = alloc_hash_contig(size);
+			backing = HASH_BACKING_PAGES;
+		}
+		if (!table && hashdist) {
 			table = __vmalloc(size, GFP_ATOMIC, PAGE_KERNEL);
-		else {
+			backing = HASH_BACKING_VMALLOC;
+		} else if (!table) {
 			/*
 			 * 如果bucketsize不是2的幂，我们可能会释放出
 			 * 在哈希表的末尾释放一些页面，这时
@@ -5323,6 +9537,7 @@ void *__init alloc_large_system_hash(const char *tablename,
 				table = alloc_pages_exact(size, GFP_ATOMIC);
 				kmemleak_alloc(table, size, 1, GFP_ATOMIC);
 			}
+			backing = HASH_BACKING_PAGES;
 		}
 	} while (!table && size > PAGE_SIZE && --log2qty);
 
@@ -5335,6 +9550,9 @@ void *__init alloc_large_system_hash(const char *tablename,
 	       ilog2(size) - PAGE_SHIFT,
 	       size);
 
+	system_hash_register(tablename, table, 1UL << log2qty, bucketsize,
+			     size, backing);
+
 	if (_hash_shift)
 		*_hash_shift = log2qty;
 	if (_hash_mask)
@@ -5570,6 +9788,157 @@ out:
 	spin_unlock_irqrestore(&zone->lock, flags);
 }
 
+#ifdef CONFIG_MEMORY_HOTPLUG
+/*
+ * 内存上线时的批量释放。online_pages()对每个页面调用online_page()，
+ * 经__free_page()逐页交给伙伴系统，每页都要拿一次zone->lock，再从0阶
+ * 一路合并上去；上线1GB要重复26万次。online_pages_batched()把范围内
+ * 对齐的MAX_ORDER块直接挂进free_area，每ONLINE_BATCH_BLOCKS块只拿一次
+ * zone->lock，首尾不对齐的零头仍按generic_online_page()的方式逐页上线。
+ *
+ * 调用者持有lock_memory_hotplug()，范围内的页面属于同一个区且都有
+ * 对应的struct page。注册了自己的online_page回调（例如气球驱动）时
+ * 不能走这条路径。返回上线的页数。
+ *
+ * 两条路径用同样的__online_page_set_limits()和
+ * __online_page_increment_counters()记账，而且都在释放之前记；
+ * free_pages_prepare()发现坏页时和__free_page()一样把它丢掉，但它已经
+ * 计入totalram_pages，与逐页上线的结果一致。
+ */
+#define ONLINE_BATCH_BLOCKS	32
+
+static unsigned long online_batched_calls;
+static unsigned long online_batched_pages;
+static unsigned long online_batched_lock_holds;
+static u64 online_batched_last_ns;
+static u64 online_batched_max_ns;
+
+static void online_free_batch(struct zone *zone, struct list_head *batch,
+			      int nr)
+{
+	struct page *page, *next;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zone->lock, flags);
+	zone->all_unreclaimable = 0;
+	zone->pages_scanned = 0;
+	list_for_each_entry_safe(page, next, batch, lru) {
+		list_del(&page->lru);
+		__free_one_page(page, zone, MAX_ORDER - 1,
+				get_pageblock_migratetype(page));
+	}
+	__mod_zone_page_state(zone, NR_FREE_PAGES,
+			      (long)nr << (MAX_ORDER - 1));
+	spin_unlock_irqrestore(&zone->lock, flags);
+	count_vm_events(PGFREE, nr << (MAX_ORDER - 1));
+}
+
+unsigned long online_pages_batched(unsigned long start_pfn,
+				   unsigned long nr_pages)
+{
+	unsigned long pfn = start_pfn, end_pfn = start_pfn + nr_pages;
+	unsigned long onlined = 0, blocks = 0, holds = 0;
+	struct zone *zone = page_zone(pfn_to_page(start_pfn));
+	u64 start = local_clock(), elapsed;
+	LIST_HEAD(batch);
+	int nr = 0;
+
+	while (pfn < end_pfn) {
+		struct page *page = pfn_to_page(pfn);
+		int i;
+
+		if ((pfn & (MAX_ORDER_NR_PAGES - 1)) ||
+		    pfn + MAX_ORDER_NR_PAGES > end_pfn) {
+			__online_page_set_limits(page);
+			__online_page_increment_counters(page);
+			__online_page_free(page);
+			onlined++;
+			pfn++;
+			continue;
+		}
+
+		for (i = 0; i < MAX_ORDER_NR_PAGES; i++) {
+			__online_page_set_limits(page + i);
+			__online_page_increment_counters(page + i);
+			__ClearPageReserved(page + i);
+			set_page_count(page + i, 0);
+		}
+		pfn += MAX_ORDER_NR_PAGES;
+		onlined += MAX_ORDER_NR_PAGES;
+		/* 检查和取消映射不需要zone->lock；坏块照旧被丢弃 */
+		if (!free_pages_prepare(page, MAX_ORDER - 1))
+			continue;
+		blocks++;
+
+		list_add_tail(&page->lru, &batch);
+		if (++nr == ONLINE_BATCH_BLOCKS) {
+			online_free_batch(zone, &batch, nr);
+			holds++;
+			nr = 0;
+			cond_resched();
+		}
+	}
+	if (nr) {
+		online_free_batch(zone, &batch, nr);
+		holds++;
+	}
+	async_alloc_kick();
+
+	elapsed = local_clock() - start;
+	online_batched_calls++;
+	online_batched_pages += onlined;
+	online_batched_lock_holds += holds;
+	online_batched_last_ns = elapsed;
+	if (elapsed > online_batched_max_ns)
+		online_batched_max_ns = elapsed;
+	printk(KERN_INFO "online %lu pages at pfn %#lx (%lu MAX_ORDER blocks, "
+	       "%lu zone->lock holds) in %llu us\n",
+	       onlined, start_pfn, blocks, holds,
+	       (unsigned long long)elapsed / NSEC_PER_USEC);
+	return onlined;
+}
+
+/*
+ * walk_system_ram_range()的回调，与memory_hotplug.c里的
+ * online_pages_range()签名相同。online_pages()在online_page回调仍是
+ * generic_online_page()时把它传给walk_system_ram_range()，
+ * 上线的页数累加到arg指向的onlined_pages。
+ */
+int online_pages_range_batched(unsigned long start_pfn,
+			       unsigned long nr_pages, void *arg)
+{
+	unsigned long *onlined_pages = arg;
+
+	*onlined_pages += online_pages_batched(start_pfn, nr_pages);
+	return 0;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int online_batched_show(struct seq_file *m, void *arg)
+{
+	seq_printf(m, "calls      %lu\npages      %lu\nlock_holds %lu\n"
+		   "last_ns    %llu\nmax_ns     %llu\n",
+		   online_batched_calls, online_batched_pages,
+		   online_batched_lock_holds,
+		   (unsigned long long)online_batched_last_ns,
+		   (unsigned long long)online_batched_max_ns);
+	return 0;
+}
+
+static int online_batched_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, online_batched_show, NULL);
+}
+
+static const struct file_operations online_batched_fops = {
+	.open		= online_batched_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+#endif /* CONFIG_MEMORY_HOTPLUG */
+
 #ifdef CONFIG_MEMORY_HOTREMOVE
 /*
  * 在调用此功能之前，必须将该范围内的所有页面隔离开来。
@@ -5606,7 +9975,7 @@ __offline_isolated_pages(unsigned long start_pfn, unsigned long end_pfn)
 #endif
 		list_del(&page->lru);
 		rmv_page_order(page);
-		zone->free_area[order].nr_free--;
+		area_del_free(zone, &zone->free_area[order]);
 		__mod_zone_page_state(zone, NR_FREE_PAGES,
 				      - (1UL << order));
 #ifdef CONFIG_HIGHMEM
@@ -5642,6 +10011,179 @@ bool is_free_buddy_page(struct page *page)
 }
 #endif
 
+struct free_range_walk {
+	struct zone *zone;
+	unsigned long start_pfn;
+	unsigned long *free_map;
+};
+
+/* pa_walk_free_blocks()的回调，调用者持有zone->lock */
+static int free_range_buddy_order(unsigned long pfn, void *arg)
+{
+	struct free_range_walk *walk = arg;
+	struct page *page;
+
+	if (!pfn_valid_within(pfn))
+		return PA_NOT_BUDDY;
+	page = pfn_to_page(pfn);
+	if (page_zone(page) != walk->zone)
+		return PA_OTHER_ZONE;
+	return PageBuddy(page) ? page_order(page) : PA_NOT_BUDDY;
+}
+
+static void free_range_mark(unsigned long pfn, unsigned long nr, void *arg)
+{
+	struct free_range_walk *walk = arg;
+
+	bitmap_set(walk->free_map, pfn - walk->start_pfn, nr);
+}
+
+/**
+ * classify_free_range - 在一次调用中把一段pfn分为空闲和在用两类
+ * @start_pfn: 第一个pfn
+ * @end_pfn: 最后一个pfn之后的pfn
+ * @free_map: 可以为NULL；否则第i位对应start_pfn + i，空闲页置位，
+ *            调用者负责清零
+ *
+ * 逐页调用is_free_buddy_page()时每页都要关中断拿一次zone->lock，并探测
+ * 最多MAX_ORDER个候选头页。这里按页块分段，每段只拿一次锁，只在段首
+ * 寻找包含它的伙伴块，之后沿着空闲块的头页按块跳过，每个pfn只探测一次。
+ * 走法在page_alloc_shared.h里，helloylt freerange用同一份代码做基准。
+ *
+ * 查询仍然是加锁的，不是请求中无锁、用序列号校验的版本：伙伴状态只在
+ * zone->lock下才是一致的（合并和拆分会同时改写多个页面的PageBuddy和
+ * 阶），序列号要在__free_one_page和expand的热路径里增加写操作。每个
+ * 页块关中断持锁一次，段与段之间放开锁，结果是逐段一致的快照。
+ *
+ * 在进程上下文中调用。返回范围内空闲页的数目。
+ */
+unsigned long classify_free_range(unsigned long start_pfn,
+				  unsigned long end_pfn, unsigned long *free_map)
+{
+	struct free_range_walk walk = {
+		.start_pfn = start_pfn,
+		.free_map = free_map,
+	};
+	unsigned long pfn = start_pfn, nr_free = 0;
+
+	while (pfn < end_pfn) {
+		unsigned long chunk_end, block_end, flags;
+
+		if (!pfn_valid(pfn)) {
+			pfn = ALIGN(pfn + 1, MAX_ORDER_NR_PAGES);
+			continue;
+		}
+
+		walk.zone = page_zone(pfn_to_page(pfn));
+		chunk_end = min(ALIGN(pfn + 1, pageblock_nr_pages), end_pfn);
+
+		spin_lock_irqsave(&walk.zone->lock, flags);
+		/* 段首可能落在一个更早开始的空闲块中间 */
+		block_end = pa_free_block_end(pfn, MAX_ORDER,
+					      free_range_buddy_order, &walk);
+		/* 区的边界落在段中间时停下，下一轮从新的区接着走 */
+		pfn = pa_walk_free_blocks(pfn, chunk_end, block_end,
+					  free_range_buddy_order,
+					  free_map ? free_range_mark : NULL,
+					  &walk, &nr_free);
+		spin_unlock_irqrestore(&walk.zone->lock, flags);
+	}
+
+	return nr_free;
+}
+EXPORT_SYMBOL_GPL(classify_free_range);
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * page_alloc/free_range：写入"起始pfn 页数"后用classify_free_range()
+ * 查询这段范围，写入"起始pfn 页数 pfn"时改为逐页调用
+ * is_free_buddy_page()（需要CONFIG_MEMORY_FAILURE），读出最近一次的
+ * 结果和耗时。hot-remove工具可以用它代替逐页的查询，helloylt freerange
+ * 用它比较两种做法。
+ */
+static DEFINE_MUTEX(free_range_mutex);
+static unsigned long free_range_start, free_range_nr, free_range_free;
+static u64 free_range_ns;
+static bool free_range_per_pfn;
+
+static int free_range_show(struct seq_file *m, void *arg)
+{
+	mutex_lock(&free_range_mutex);
+	seq_printf(m, "start_pfn %lu\nnr_pages %lu\nfree %lu\nns %llu\n"
+		   "mode %s\n", free_range_start, free_range_nr,
+		   free_range_free, (unsigned long long)free_range_ns,
+		   free_range_per_pfn ? "pfn" : "range");
+	mutex_unlock(&free_range_mutex);
+	return 0;
+}
+
+static int free_range_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, free_range_show, NULL);
+}
+
+static ssize_t free_range_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	unsigned long start, nr, pfn, nr_free = 0;
+	char buf[64], mode[8] = "";
+	bool per_pfn;
+	u64 ns;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%lu %lu %7s", &start, &nr, mode) < 2 ||
+	    start + nr < start)
+		return -EINVAL;
+	per_pfn = !strcmp(mode, "pfn");
+	if (!per_pfn && mode[0])
+		return -EINVAL;
+
+	ns = local_clock();
+	if (per_pfn) {
+#ifdef CONFIG_MEMORY_FAILURE
+		for (pfn = start; pfn < start + nr; pfn++) {
+			if (pfn_valid(pfn) && is_free_buddy_page(pfn_to_page(pfn)))
+				nr_free++;
+			if (!(pfn & (pageblock_nr_pages - 1)))
+				cond_resched();
+		}
+#else
+		return -EINVAL;
+#endif
+	} else {
+		for (pfn = start; pfn < start + nr; pfn += pageblock_nr_pages) {
+			nr_free += classify_free_range(pfn,
+				min(pfn + pageblock_nr_pages, start + nr), NULL);
+			cond_resched();
+		}
+	}
+	ns = local_clock() - ns;
+
+	mutex_lock(&free_range_mutex);
+	free_range_start = start;
+	free_range_nr = nr;
+	free_range_free = nr_free;
+	free_range_ns = ns;
+	free_range_per_pfn = per_pfn;
+	mutex_unlock(&free_range_mutex);
+
+	return count;
+}
+
+static const struct file_operations free_range_fops = {
+	.open		= free_range_open,
+	.read		= seq_read,
+	.write		= free_range_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif /* CONFIG_DEBUG_FS */
+
 static struct trace_print_flags pageflag_names[] = {
 	{1UL << PG_locked,		"locked"	},
 	{1UL << PG_error,		"error"		},
@@ -5718,3 +10260,106 @@ void dump_page(struct page *page)
 	dump_page_flags(page->flags);
 	mem_cgroup_print_bad_page(page);
 }
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *page_alloc_debugfs_root;
+
+static int __init page_alloc_debugfs_init(void)
+{
+	page_alloc_debugfs_root = debugfs_create_dir("page_alloc", NULL);
+	if (!page_alloc_debugfs_root)
+		return -ENOMEM;
+
+	debugfs_create_file("migrate_reserve", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &migrate_reserve_fops);
+	debugfs_create_u32("atomic_fastfail", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &atomic_fastfail);
+	debugfs_create_file("atomic_fastfail_stats", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &atomic_fastfail_fops);
+	debugfs_create_u32("slowpath_profile", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &slowpath_profile);
+	debugfs_create_file("slowpath_stats", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &slowpath_stats_fops);
+	debugfs_create_file("slowpath_worst", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &slowpath_worst_fops);
+	debugfs_create_u32("kswapd_wake_interval_ms", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &kswapd_wake_interval_ms);
+	debugfs_create_file("kswapd_wake_stats", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &kswapd_wake_fops);
+	debugfs_create_file("page_colour", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &page_colour_fops);
+	debugfs_create_file("system_hashes", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &system_hashes_fops);
+	debugfs_create_file("zonelist_rebuild", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &zonelist_rebuild_fops);
+	debugfs_create_file("wait_tables", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &wait_tables_fops);
+	debugfs_create_file("wait_bench", S_IRUSR | S_IWUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &wait_bench_fops);
+	debugfs_create_u32("alloc_fail_snapshot", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &alloc_fail_snapshot);
+	debugfs_create_file("free_area_snapshot", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &fa_snapshot_fops);
+	debugfs_create_u32("alloc_fail_aggregate", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &alloc_fail_aggregate);
+	debugfs_create_u32("alloc_fail_digest_secs", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &alloc_fail_digest_secs);
+	debugfs_create_u32("page_check_level", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &page_check_level);
+	debugfs_create_file("page_check_cycles", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &page_check_cycles_fops);
+	debugfs_create_file("zero_bench", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &zero_bench_fops);
+	debugfs_create_u32("deferred_free", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &deferred_free);
+	debugfs_create_u32("deferred_free_batch", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &deferred_free_batch);
+	debugfs_create_file("deferred_free_stats", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &deferred_free_fops);
+	debugfs_create_u32("high_order_pcp", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &high_order_pcp);
+	debugfs_create_u32("high_order_pcp_batch", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &high_order_pcp_batch);
+	debugfs_create_u32("high_order_pcp_high", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &high_order_pcp_high);
+	debugfs_create_file("high_order_bench", S_IRUSR | S_IWUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &hpcp_bench_fops);
+#ifdef CONFIG_STACKTRACE
+	debugfs_create_file("page_owner", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &page_owner_fops);
+#endif
+	debugfs_create_file("pcp_config", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &pcp_config_fops);
+	debugfs_create_file("free_range", S_IRUSR | S_IWUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &free_range_fops);
+#ifdef CONFIG_MEMORY_HOTPLUG
+	debugfs_create_file("online_batched", S_IRUSR,
+			    page_alloc_debugfs_root, NULL,
+			    &online_batched_fops);
+#endif
+#ifdef CONFIG_DEBUG_PAGEALLOC
+	debugfs_create_u32("debug_guardpage_sample", S_IRUSR | S_IWUSR,
+			   page_alloc_debugfs_root, &debug_guardpage_sample);
+#endif
+	return 0;
+}
+late_initcall(page_alloc_debugfs_init);
+#endif /* CONFIG_DEBUG_FS */